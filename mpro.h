@@ -2,10 +2,18 @@
 #ifndef _MPRO_H_
 #define _MPRO_H_
 
+#include <linux/hrtimer.h>
 #include <linux/platform_device.h>
 #include <linux/platform_data/simplefb.h>
 #include <linux/iosys-map.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/scatterlist.h>
+#include <linux/spinlock.h>
 #include <linux/usb.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include <drm/drm_drv.h>
 #include <drm/drm_device.h>
@@ -18,6 +26,32 @@
 #include <drm/drm_encoder.h>
 #include <drm/drm_crtc.h>
 #include <drm/drm_rect.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_gem_atomic_helper.h>
+
+#ifndef DRM_FORMAT_CONV_STATE_INIT
+
+struct drm_format_conv_state {
+	struct {
+		void *mem;
+		size_t size;
+		bool preallocated;
+	} tmp;
+};
+
+#define __DRM_FORMAT_CONV_STATE_INIT(_mem, _size, _preallocated) { \
+		.tmp = { \
+			.mem = (_mem), \
+			.size = (_size), \
+			.preallocated = (_preallocated), \
+		} \
+	}
+
+#define DRM_FORMAT_CONV_STATE_INIT \
+	__DRM_FORMAT_CONV_STATE_INIT(NULL, 0, false)
+
+#endif
 
 // We only support rgb565 though..
 #define MPRO_FORMATS \
@@ -28,6 +62,64 @@
 
 #define MPRO_BPP	16
 #define MPRO_MAX_DELAY	100
+#define MPRO_QUERY_TRIES	2	/* attempts of an identification query */
+
+#define MPRO_FRAMES	2	/* staging buffers, one converting while other is on the wire */
+#define MPRO_MAX_CMDS	16	/* draw commands per frame before falling back to full frame */
+#define MPRO_CMD_SIZE	12
+#define MPRO_MAX_CLIPS	64	/* damage clips considered by the optimizer */
+#define MPRO_MERGE_PASSES	(2 * MPRO_MAX_CMDS)	/* bound of the pairwise merge */
+
+/* damage optimizer defaults */
+#define MPRO_CMD_COST		8192	/* control message round trip, in bulk bytes */
+#define MPRO_DAMAGE_THRESHOLD	75	/* percent of panel area before going full frame */
+#define MPRO_DAMAGE_ALIGN	2	/* horizontal pixel alignment of rects */
+#define MPRO_DIRTY_LINES	16	/* height of bands compared in dirty mode */
+#define MPRO_STREAM_LINES	64	/* lines converted before they are released to usb */
+
+/* config.partial */
+#define MPRO_PARTIAL_OFF	0
+#define MPRO_PARTIAL_ON		1
+#define MPRO_PARTIAL_AUTO	2	/* measured command cost, with hysteresis */
+
+/* adaptive policy, partial cost in percent of a full frame update */
+#define MPRO_POLICY_HIGH	90	/* go full frame above this */
+#define MPRO_POLICY_LOW		60	/* back to partial below this */
+#define MPRO_RATE_MIN_BYTES	4096	/* smaller transfers don't tell link rate */
+
+/* rotation, lines turning into columns are converted this many at a time */
+#define MPRO_TILE		16
+#define MPRO_SIMD_LINES		MPRO_TILE	/* lines per fpu/neon section */
+
+/* planes composed by the driver over the primary one */
+#define MPRO_CURSOR_SIZE	64	/* largest cursor image */
+#define MPRO_OVERLAYS		2
+#define MPRO_LAYER_CURSOR	MPRO_OVERLAYS	/* index of the cursor in layers */
+#define MPRO_LAYERS		(MPRO_OVERLAYS + 1)
+
+/* parallel conversion */
+#define MPRO_BANDS		4	/* max cores converting one rect */
+#define MPRO_BAND_PIXELS	(256 * 1024)	/* rects smaller than this stay single threaded */
+#define MPRO_BAND_LINES		64	/* min lines per band */
+
+/* runtime tunables */
+#define MPRO_CHUNK_ALIGN	512	/* bulk chunks are whole high speed packets */
+#define MPRO_HZ_MAX		240	/* highest pacing rate accepted */
+
+/* transfer watchdog, an urb gets slack plus margin times its expected time */
+#define MPRO_CHUNK_DEFAULT	(256 * 1024)	/* bulk urb length unless set otherwise */
+#define MPRO_RATE_FLOOR		(4 * 1024 * 1024)	/* bytes per second assumed before the link is measured */
+#define MPRO_XFER_MARGIN	4
+#define MPRO_XFER_RETRIES	2	/* resends of a failed command before its frame is dropped */
+
+enum mpro_tunable {
+	MPRO_TUNE_PARTIAL = 0,
+	MPRO_TUNE_FLIPX,
+	MPRO_TUNE_THRESHOLD,
+	MPRO_TUNE_CHUNK,
+	MPRO_TUNE_HZ,
+	MPRO_TUNE_COUNT,
+};
 
 struct mpro_format {
 	const char *name;
@@ -54,6 +146,205 @@ struct mpro_info {
 struct mpro_config {
 	char flipx;
 	char partial;
+	char dirty;
+	char stream;	/* full frames go on the wire while they are converted */
+	char suppress;	/* repeated commits are compared before they are sent */
+	unsigned int cmd_cost;
+	unsigned int threshold;
+	unsigned int align;
+	unsigned int chunk;	/* max bulk urb length, 0 sends each command in one urb */
+	unsigned int hz;	/* vblank pacing, 0 follows the panel */
+};
+
+/* primary plane state, conversion kernels are resolved in atomic_check */
+struct mpro_plane_state {
+	struct drm_shadow_plane_state base;
+	const struct mpro_kernels *kernels;
+	bool layers_only;	/* added to the commit by a layer update, see mpro_layer.c */
+};
+
+/* overlay or cursor plane as last committed, blended into the frames by the primary plane update */
+struct mpro_layer {
+	struct drm_plane plane;
+	u32 *image;		/* premultiplied argb8888 with plane alpha applied */
+	unsigned int pitch;	/* image pixels per line */
+	struct drm_rect rect;	/* crtc coordinates, clipped to the panel */
+	struct drm_rect damage;	/* crtc coordinates, image changed here since last drawn */
+	struct drm_rect shown;	/* panel coordinates, where the frames have it */
+	unsigned int zpos;
+	bool visible;
+};
+
+/* connector state carrying the tunables set through drm properties */
+struct mpro_connector_state {
+	struct drm_connector_state base;
+	unsigned int values[MPRO_TUNE_COUNT];
+};
+
+struct mpro_damage {
+	struct drm_rect rects[MPRO_MAX_CLIPS];
+	unsigned int nrects;
+	unsigned long pixels;	/* damaged pixels before optimizing */
+	bool full;
+};
+
+/* debugfs performance counters */
+enum mpro_perf_counter {
+	MPRO_PERF_FRAMES = 0,
+	MPRO_PERF_PARTIAL_BLITS,
+	MPRO_PERF_FULL_BLITS,
+	MPRO_PERF_BYTES,
+	MPRO_PERF_DAMAGE_PIXELS,
+	MPRO_PERF_SENT_PIXELS,
+	MPRO_PERF_USB_ERRORS,
+	MPRO_PERF_TIMEOUTS,
+	MPRO_PERF_RETRIES,
+	MPRO_PERF_CLIPS,	/* damage clips of commits */
+	MPRO_PERF_RECTS,	/* rects left after optimizing them */
+	MPRO_PERF_MERGES,
+	MPRO_PERF_TRIMS,
+	MPRO_PERF_SPLITS,
+	MPRO_PERF_FULL_FRAMES,	/* commits sent as one full update */
+	MPRO_PERF_UNCHANGED,	/* dirty mode commits without changes */
+	MPRO_PERF_SWITCHES,	/* adaptive policy changes */
+	MPRO_PERF_COALESCED,	/* commits merged into a queued frame */
+	MPRO_PERF_DROPPED,	/* frames lost to errors and timeouts */
+	MPRO_PERF_COUNTERS,
+};
+
+/* latency histograms, log2 buckets of microseconds */
+enum mpro_perf_latency {
+	MPRO_LAT_CONVERT = 0,	/* pixel conversion of one commit */
+	MPRO_LAT_CTRL,		/* cmd_draw control message */
+	MPRO_LAT_BULK,		/* bulk payload of one command */
+	MPRO_LAT_COMMIT,	/* plane update until the frame reached the panel */
+	MPRO_LAT_COUNT,
+};
+
+#define MPRO_HIST_BUCKETS	24	/* last bucket collects everything above 4 s */
+
+struct mpro_perf {
+	u64 counters[MPRO_PERF_COUNTERS];
+	u64 hist[MPRO_LAT_COUNT][MPRO_HIST_BUCKETS];
+};
+
+/* framebuffer, imported buffers keep their vmap while it exists */
+struct mpro_framebuffer {
+	struct drm_framebuffer base;
+	struct iosys_map map[DRM_FORMAT_MAX_PLANES];
+	struct iosys_map data[DRM_FORMAT_MAX_PLANES];
+	bool mapped;
+};
+
+struct mpro_conv_job;
+
+typedef void (*mpro_kernel_fn)(const struct mpro_conv_job *job, unsigned int first, unsigned int last, void *tmp);
+
+/* how source lines land on the panel */
+enum mpro_xfrm_mode {
+	MPRO_XFRM_ROWS = 0,	/* as lines, left to right */
+	MPRO_XFRM_MIRRORED,	/* as lines, right to left */
+	MPRO_XFRM_COLUMNS,	/* as columns, rotated by 90 or 270 degrees */
+	MPRO_XFRM_MODES,
+};
+
+/* row kernels of one source format and source caching, see mpro_flip.c */
+struct mpro_kernels {
+	const char *name;
+	mpro_kernel_fn fn[MPRO_XFRM_MODES];
+	bool simd;	/* needs fpu/neon section */
+	const struct mpro_kernels *fallback;	/* scalar kernels for when simd can't be used */
+};
+
+/* kernels of the fastest instruction set, indexed by cached source */
+struct mpro_line_ops {
+	const char *name;
+	const struct mpro_kernels *xrgb8888;
+};
+
+/* one rect to convert, clip in framebuffer coordinates */
+struct mpro_conv_job {
+	u16 *dbuf;		/* where first source pixel lands, or last one when mirrored */
+	int du;			/* panel offset to next pixel of a source line, in pixels */
+	int dv;			/* panel offset to next source line, in pixels */
+	const void *vaddr;	/* first source pixel */
+	unsigned int src_pitch;
+	unsigned int width;	/* source pixels per line */
+	size_t sbuf_len;	/* bytes per source line */
+	size_t stmp_len;	/* line copy of uncached sources, strip follows it */
+	enum mpro_xfrm_mode mode;
+	const struct mpro_kernels *kernels;
+	struct drm_rect clip;
+};
+
+struct mpro_band {
+	struct work_struct work;
+	struct mpro_device *mpro;
+	struct drm_format_conv_state state;
+
+	/* source lines of the job converted by this band */
+	const struct mpro_conv_job *job;
+	unsigned int first;
+	unsigned int last;
+};
+
+enum mpro_frame_state {
+	MPRO_FRAME_IDLE = 0,	/* free, may be converted into */
+	MPRO_FRAME_QUEUED,	/* waiting for previous frame to leave */
+	MPRO_FRAME_BUSY,	/* urbs in flight */
+};
+
+struct mpro_cmd {
+	unsigned char *buf;	/* cmd_draw, points into frame cmdbuf */
+	unsigned int len;
+	void *data;		/* bulk payload */
+	struct sg_table *sgt;	/* or payload pages, data is NULL then */
+	unsigned int size;
+	struct drm_rect rect;
+};
+
+struct mpro_frame {
+	struct mpro_device *mpro;
+	unsigned char *data;
+	unsigned char *pack;	/* partial rects gathered in device layout */
+	unsigned int pack_len;
+	enum mpro_frame_state state;
+	int status;
+	ktime_t start;		/* when it went on the wire */
+	ktime_t cmd_start;	/* when current ctrl or bulk urb was submitted */
+	ktime_t commit;		/* when the plane update producing it started */
+	unsigned int chunk;	/* config.chunk when the frame was queued */
+	unsigned int offset;	/* bytes of current command payload sent */
+	unsigned int ready;	/* bytes of data converted, see mpro_frame_ready() */
+	bool starved;		/* bulk transfer waits for ready to grow */
+	bool parked;		/* current command was starved, its time is not the link's */
+	unsigned int retries;	/* commands of this frame sent again */
+	int pm;			/* holds a runtime pm reference until done */
+	bool timedout;		/* urbs unlinked by the watchdog */
+	u64 ctrl_ns;		/* control message time of current command */
+
+	/* area where the other frame holds newer pixels than this one */
+	struct drm_rect stale;
+
+	/* rects of a queued frame taken back by a newer commit */
+	struct drm_rect carry[MPRO_MAX_CMDS];
+	unsigned int ncarry;
+
+	/* out fence of a direct flush, signalled when the frame is done */
+	struct dma_fence *fence;
+
+	/* framebuffer pages sent directly, see mpro_blit_direct() */
+	struct sg_table sgt;
+	struct page **pages;
+	unsigned int npages;
+
+	struct urb *ctrl_urb;
+	struct urb *bulk_urb;
+	struct usb_ctrlrequest *setup;
+	unsigned char *cmdbuf;
+	struct mpro_cmd cmds[MPRO_MAX_CMDS];
+	unsigned int ncmds;
+	unsigned int cur;
 };
 
 struct mpro_device {
@@ -66,13 +357,57 @@ struct mpro_device {
 	unsigned int pitch; // pixels on line!!
 
 	/* memory management */
-	struct iosys_map screen_base;
-	unsigned char* data;
 	unsigned int block_size;
+	unsigned char *conv;	/* conversion output compared in dirty mode */
+
+	/* transfer pipeline */
+	struct mpro_frame frames[MPRO_FRAMES];
+	struct mpro_frame *active;
+	struct mpro_frame *pending;
+	unsigned int next;
+	bool stopped;
+	bool resync;	/* frames lack the last directly sent framebuffer */
+	spinlock_t xfer_lock;
+	wait_queue_head_t xfer_wait;
+	struct hrtimer xfer_timer;	/* watchdog of the urb on the wire */
+	unsigned int xfer_seq;	/* bumped when an urb is armed and when it completes */
+	unsigned int xfer_armed;	/* xfer_seq of the last armed urb */
+	struct work_struct retry_work;
+	int retry_status;
+	struct drm_rect lost;	/* rects of dropped frames, sent again with the next one */
+	struct work_struct replay_work;	/* last frame sent again on resume */
+	bool replay;	/* resumed, no frame flushed since */
+	bool sleeping;	/* system suspend, modeset state saved by the helper */
+
+	/* direct flush, see mpro_flush_ioctl() */
+	struct drm_gem_object *flush_obj;	/* last flushed buffer, kept mapped */
+	struct iosys_map flush_map;
+	spinlock_t fence_lock;
+	u64 fence_context;
+	u64 fence_seqno;
+
+	/* emulated vblank, paced by the link */
+	struct hrtimer vblank_timer;
+	u64 frame_ns;		/* average time a frame spends on the wire */
+
+	/* link measurements, running averages */
+	u64 ctrl_ns;		/* cmd_draw round trip */
+	u64 rate;		/* bulk bytes per second */
+	bool policy_full;	/* last adaptive decision */
+	bool vblank_deferred;	/* tick fell on a transfer, signal on completion */
+	bool vblank_on;		/* between enable_vblank and disable_vblank */
+
+	/* pixel conversion */
+	const struct mpro_line_ops *line_ops;
+	struct drm_format_conv_state conv_state;
+	struct workqueue_struct *conv_wq;
+	struct mpro_band bands[MPRO_BANDS];	/* band 0 runs in the commit thread */
+	unsigned int nbands;
 
 	/* modesetting */
-	uint32_t formats[8];
+	uint32_t formats[8];	/* native one and mpro_formats */
 	struct drm_plane primary_plane;
+	struct mpro_layer layers[MPRO_LAYERS];	/* overlays, then the cursor */
 	struct drm_crtc crtc;
 	struct drm_encoder encoder;
 	struct drm_connector connector;
@@ -83,12 +418,25 @@ struct mpro_device {
 	unsigned char id[8];
 	struct mpro_info info;
 	struct mpro_config config;
+	struct mutex config_lock;	/* config against the commit path */
+	bool redraw;	/* config change needs the whole plane converted again */
+	struct drm_property *props[MPRO_TUNE_COUNT];
+	struct mpro_damage damage;
+	struct mpro_damage dirty;
+	struct mpro_perf __percpu *perf;
 
 	unsigned char cmd[64];
 };
 
+/* formats converted to the native one, see mpro_kernels_lookup() */
 static const uint32_t mpro_formats[] = {
 	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_XBGR8888,
+	DRM_FORMAT_ABGR8888,
+	DRM_FORMAT_RGB888,
+	DRM_FORMAT_BGR888,
+	DRM_FORMAT_BGR565,
 };
 
 static const uint64_t mpro_primary_plane_format_modifiers[] = {
@@ -100,21 +448,140 @@ static inline struct mpro_device *to_mpro(struct drm_device *dev) {
 	return container_of(dev, struct mpro_device, dev);
 }
 
+static inline struct mpro_framebuffer *to_mpro_framebuffer(const struct drm_framebuffer *fb) {
+	return container_of((struct drm_framebuffer *)fb, struct mpro_framebuffer, base);
+}
+
+static inline struct mpro_plane_state *to_mpro_plane_state(struct drm_plane_state *state) {
+	return container_of(to_drm_shadow_plane_state(state), struct mpro_plane_state, base);
+}
+
+static inline struct mpro_connector_state *to_mpro_connector_state(struct drm_connector_state *state) {
+	return container_of(state, struct mpro_connector_state, base);
+}
+
+static inline void mpro_rect_union(struct drm_rect *r, const struct drm_rect *a) {
+
+	if ( !drm_rect_visible(a))
+		return;
+
+	if ( !drm_rect_visible(r)) {
+		*r = *a;
+		return;
+	}
+
+	r -> x1 = min(r -> x1, a -> x1);
+	r -> y1 = min(r -> y1, a -> y1);
+	r -> x2 = max(r -> x2, a -> x2);
+	r -> y2 = max(r -> y2, a -> y2);
+}
+
+/* per cpu, safe from completion handlers, summed when read */
+static inline void mpro_perf_add(struct mpro_device *mpro, enum mpro_perf_counter counter, u64 value) {
+	this_cpu_add(mpro -> perf -> counters[counter], value);
+}
+
+static inline void mpro_perf_latency(struct mpro_device *mpro, enum mpro_perf_latency latency, u64 ns) {
+
+	unsigned int bucket = min_t(unsigned int, fls64(div_u64(ns, NSEC_PER_USEC)), MPRO_HIST_BUCKETS - 1);
+
+	this_cpu_inc(mpro -> perf -> hist[latency][bucket]);
+}
+
+/* drm minor, identifies the panel in traces */
+static inline unsigned int mpro_minor(struct mpro_device *mpro) {
+	return mpro -> dev.primary -> index;
+}
+
 static inline struct usb_device *mpro_to_usb_device(struct mpro_device *mpro) {
 	return interface_to_usbdev(to_usb_interface(mpro -> dev.dev));
 }
 
-void drm_fb_xrgb8888_to_rgb565_flipped(struct iosys_map *dst, const unsigned int *dst_pitch,
-				       const struct iosys_map *src, const struct drm_framebuffer *fb,
-				       const struct drm_rect *clip, bool swab);
+int mpro_conv_init(struct mpro_device *mpro);
+void mpro_select_line_ops(struct mpro_device *mpro);
+const struct mpro_kernels *mpro_kernels_lookup(struct mpro_device *mpro, const struct drm_framebuffer *fb);
+void mpro_fb_convert(struct mpro_device *mpro, const struct mpro_kernels *kernels,
+		     struct iosys_map *dst, const unsigned int *dst_pitch,
+		     const struct iosys_map *src, const struct drm_framebuffer *fb,
+		     const struct drm_rect *clip, unsigned int rotation);
+unsigned int mpro_rotation(struct mpro_device *mpro, const struct drm_plane_state *plane_state);
+void mpro_rect_to_panel(const struct drm_plane_state *plane_state, unsigned int rotation, struct drm_rect *r);
+void mpro_rect_to_fb(const struct drm_plane_state *plane_state, unsigned int rotation, struct drm_rect *r);
+
+/* vectorized line converters of mpro_simd.c, conditions match the Makefile */
+#if defined(CONFIG_CC_IS_CLANG) || CONFIG_GCC_VERSION >= 90000
+#if defined(CONFIG_X86_64)
+#define MPRO_SIMD_X86
+#elif defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+#define MPRO_SIMD_NEON
+#endif
+#endif
+
+#if defined(MPRO_SIMD_X86)
+void mpro_xrgb8888_to_rgb565_line_sse2(void *dbuf, const void *sbuf, unsigned int pixels);
+void mpro_xrgb8888_to_rgb565_line_flipped_sse2(void *dbuf, const void *sbuf, unsigned int pixels);
+void mpro_xrgb8888_to_rgb565_line_avx2(void *dbuf, const void *sbuf, unsigned int pixels);
+void mpro_xrgb8888_to_rgb565_line_flipped_avx2(void *dbuf, const void *sbuf, unsigned int pixels);
+#elif defined(MPRO_SIMD_NEON)
+void mpro_xrgb8888_to_rgb565_line_neon(void *dbuf, const void *sbuf, unsigned int pixels);
+void mpro_xrgb8888_to_rgb565_line_flipped_neon(void *dbuf, const void *sbuf, unsigned int pixels);
+#endif
 
 int mpro_mode(struct mpro_device *mpro);
 int mpro_modeset(struct mpro_device* mpro);
-int mpro_blit(struct mpro_device *mpro, struct drm_rect *rect);
+int mpro_blit(struct mpro_device *mpro, struct mpro_frame *frame, struct drm_rect *rect);
+int mpro_blit_direct(struct mpro_device *mpro, struct mpro_frame *frame, const void *vaddr);
+
+u64 mpro_cmd_cost(struct mpro_device *mpro);
+void mpro_damage_init(struct mpro_damage *d);
+void mpro_damage_add(struct mpro_device *mpro, struct mpro_damage *d, const struct drm_rect *clip);
+void mpro_damage_optimize(struct mpro_device *mpro, struct mpro_damage *d);
+void mpro_damage_diff(struct mpro_device *mpro, struct mpro_damage *d, unsigned char *dst,
+		      const unsigned char *src, const struct drm_rect *rect);
+
+int mpro_urb_init(struct mpro_device *mpro);
+void mpro_urb_stop(struct mpro_device *mpro);
+int mpro_urb_suspend(struct mpro_device *mpro, bool autosuspend);
+void mpro_urb_resume(struct mpro_device *mpro);
+bool mpro_frame_pending_direct(struct mpro_device *mpro);
+struct mpro_frame *mpro_frame_begin(struct mpro_device *mpro);
+int mpro_frame_flush(struct mpro_device *mpro, struct mpro_frame *frame, const struct drm_rect *area);
+int mpro_frame_map(struct mpro_frame *frame, const void *vaddr, size_t size);
+void mpro_frame_ready(struct mpro_device *mpro, struct mpro_frame *frame, unsigned int ready);
+struct dma_fence *mpro_frame_fence(struct mpro_device *mpro, struct mpro_frame *frame);
+
+int mpro_flush_init(struct mpro_device *mpro);
+int mpro_flush_ioctl(struct drm_device *dev, void *data, struct drm_file *file);
+
+struct dma_buf;
+
+struct drm_gem_object *mpro_gem_prime_import(struct drm_device *dev, struct dma_buf *dma_buf);
+struct drm_framebuffer *mpro_fb_create(struct drm_device *dev, struct drm_file *file,
+				       const struct drm_mode_fb_cmd2 *mode_cmd);
+bool mpro_fb_mapped(const struct drm_framebuffer *fb);
+int mpro_fb_begin_access(struct drm_plane *plane, struct drm_plane_state *plane_state);
+void mpro_fb_end_access(struct drm_plane *plane, struct drm_plane_state *plane_state);
 
 int mpro_init_planes(struct mpro_device *mpro);
+int mpro_init_layers(struct mpro_device *mpro);
+bool mpro_layers_visible(struct mpro_device *mpro);
+void mpro_layers_damage(struct mpro_device *mpro, struct mpro_damage *d);
+void mpro_layers_blend(struct mpro_device *mpro, void *dst, unsigned int pitch, const struct drm_rect *rect);
+void mpro_layers_reset(struct mpro_device *mpro);
 int mpro_init_connector(struct mpro_device *mpro);
+void mpro_connector_sync(struct mpro_device *mpro, enum mpro_tunable tunable);
 int mpro_init_sysfs(struct mpro_device *mpro);
+void mpro_remove_sysfs(struct mpro_device *mpro);
+
+int mpro_config_check(struct mpro_device *mpro, enum mpro_tunable tunable, unsigned int *value);
+int mpro_config_set(struct mpro_device *mpro, enum mpro_tunable tunable, unsigned int value);
+unsigned int mpro_config_get(struct mpro_device *mpro, enum mpro_tunable tunable);
+void mpro_atomic_commit_tail(struct drm_atomic_state *state);
+
+u64 mpro_vblank_period(struct mpro_device *mpro);
+
+int mpro_perf_init(struct mpro_device *mpro);
+void mpro_debugfs_init(struct drm_minor *minor);
 
 int mpro_fbdev_setup(struct mpro_device *mpro, unsigned int preferred_bpp);
 
@@ -1,10 +1,121 @@
 /* SPDX-License-Identifier: MIT */
+#include <drm/drm_atomic.h>
 #include <drm/drm_atomic_helper.h>
 #include <drm/drm_modeset_helper_vtables.h>
 #include <drm/drm_atomic_state_helper.h>
+#include <drm/drm_managed.h>
+#include <drm/drm_print.h>
 #include <drm/drm_probe_helper.h>
+#include <drm/drm_vblank.h>
+#include <linux/hrtimer.h>
+#include <linux/slab.h>
 #include "mpro.h"
 
+/*
+ * The panel has no vblank, so one is emulated: a hrtimer ticks at
+ * info.hz, or config.hz when set, or slower when frames take longer
+ * than that on the wire.
+ * Ticks falling on a transfer are held back until the transfer
+ * completes, so flip events carry the time the panel got the frame.
+ */
+u64 mpro_vblank_period(struct mpro_device *mpro) {
+
+	unsigned int hz = READ_ONCE(mpro -> config.hz);
+	u64 period = div_u64(NSEC_PER_SEC, hz ? hz : mpro -> info.hz);
+
+	return max(period, READ_ONCE(mpro -> frame_ns));
+}
+
+static enum hrtimer_restart mpro_vblank_timer(struct hrtimer *timer) {
+
+	struct mpro_device *mpro = container_of(timer, struct mpro_device, vblank_timer);
+	bool busy;
+	unsigned long flags;
+
+	// vblank off, disable_vblank could not wait for this callback
+	if ( !READ_ONCE(mpro -> vblank_on))
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(timer, ns_to_ktime(mpro_vblank_period(mpro)));
+
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+	busy = mpro -> active != NULL;
+	if ( busy )
+		mpro -> vblank_deferred = true;
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	if ( !busy )
+		drm_crtc_handle_vblank(&mpro -> crtc);
+
+	return HRTIMER_RESTART;
+}
+
+static int mpro_crtc_enable_vblank(struct drm_crtc *crtc) {
+
+	struct mpro_device *mpro = to_mpro(crtc -> dev);
+
+	WRITE_ONCE(mpro -> vblank_on, true);
+	hrtimer_start(&mpro -> vblank_timer, ns_to_ktime(mpro_vblank_period(mpro)), HRTIMER_MODE_REL);
+	return 0;
+}
+
+/*
+ * Called with vblank_time_lock held and irqs off. The tick handler takes
+ * that lock, so it must not be waited for here: the flag stops it and
+ * held back ticks, the blocking cancel is left to atomic_disable and
+ * device release.
+ */
+static void mpro_crtc_disable_vblank(struct drm_crtc *crtc) {
+
+	struct mpro_device *mpro = to_mpro(crtc -> dev);
+	unsigned long flags;
+
+	WRITE_ONCE(mpro -> vblank_on, false);
+
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+	mpro -> vblank_deferred = false;
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	hrtimer_try_to_cancel(&mpro -> vblank_timer);
+}
+
+static void mpro_vblank_release(struct drm_device *dev, void *res) {
+
+	struct mpro_device *mpro = to_mpro(dev);
+
+	WRITE_ONCE(mpro -> vblank_on, false);
+	hrtimer_cancel(&mpro -> vblank_timer);
+}
+
+static void mpro_crtc_helper_atomic_flush(struct drm_crtc *crtc, struct drm_atomic_state *state) {
+
+	struct drm_crtc_state *crtc_state = drm_atomic_get_new_crtc_state(state, crtc);
+	struct drm_pending_vblank_event *event = crtc_state -> event;
+
+	if ( !event )
+		return;
+
+	crtc_state -> event = NULL;
+
+	spin_lock_irq(&crtc -> dev -> event_lock);
+	if ( crtc_state -> active && drm_crtc_vblank_get(crtc) == 0 )
+		drm_crtc_arm_vblank_event(crtc, event);
+	else
+		drm_crtc_send_vblank_event(crtc, event);
+	spin_unlock_irq(&crtc -> dev -> event_lock);
+}
+
+static void mpro_crtc_helper_atomic_enable(struct drm_crtc *crtc, struct drm_atomic_state *state) {
+
+	drm_crtc_vblank_on(crtc);
+}
+
+static void mpro_crtc_helper_atomic_disable(struct drm_crtc *crtc, struct drm_atomic_state *state) {
+
+	drm_crtc_vblank_off(crtc);
+	hrtimer_cancel(&to_mpro(crtc -> dev) -> vblank_timer);
+}
+
 static enum drm_mode_status mpro_crtc_helper_mode_valid(struct drm_crtc *crtc,
 							     const struct drm_display_mode *mode) {
 	struct mpro_device *mpro = to_mpro(crtc -> dev);
@@ -14,6 +125,9 @@ static enum drm_mode_status mpro_crtc_helper_mode_valid(struct drm_crtc *crtc,
 static const struct drm_crtc_helper_funcs mpro_crtc_helper_funcs = {
 	.mode_valid = mpro_crtc_helper_mode_valid,
 	.atomic_check = drm_crtc_helper_atomic_check,
+	.atomic_flush = mpro_crtc_helper_atomic_flush,
+	.atomic_enable = mpro_crtc_helper_atomic_enable,
+	.atomic_disable = mpro_crtc_helper_atomic_disable,
 };
 
 static const struct drm_crtc_funcs mpro_crtc_funcs = {
@@ -23,6 +137,8 @@ static const struct drm_crtc_funcs mpro_crtc_funcs = {
 	.page_flip = drm_atomic_helper_page_flip,
 	.atomic_duplicate_state = drm_atomic_helper_crtc_duplicate_state,
 	.atomic_destroy_state = drm_atomic_helper_crtc_destroy_state,
+	.enable_vblank = mpro_crtc_enable_vblank,
+	.disable_vblank = mpro_crtc_disable_vblank,
 };
 
 static const struct drm_encoder_funcs mpro_encoder_funcs = {
@@ -35,18 +151,214 @@ static int mpro_connector_helper_get_modes(struct drm_connector *connector) {
 	return drm_connector_helper_get_modes_fixed(connector, &mpro -> mode);
 }
 
+/*
+ * Tunables are checked here so that applying them in commit tail cannot
+ * fail; values rounded by the check are stored rounded, like a read back
+ * from sysfs would show them.
+ */
+static int mpro_connector_helper_atomic_check(struct drm_connector *connector, struct drm_atomic_state *state) {
+
+	struct mpro_device *mpro = to_mpro(connector -> dev);
+	struct mpro_connector_state *old = to_mpro_connector_state(drm_atomic_get_old_connector_state(state, connector));
+	struct mpro_connector_state *new = to_mpro_connector_state(drm_atomic_get_new_connector_state(state, connector));
+	int i;
+
+	for ( i = 0; i < MPRO_TUNE_COUNT; i++ ) {
+
+		if ( new -> values[i] == old -> values[i] )
+			continue;
+
+		if ( mpro_config_check(mpro, i, &new -> values[i])) {
+			drm_dbg_atomic(connector -> dev, "tunable %s: value %u out of range\n",
+				       mpro -> props[i] -> name, new -> values[i]);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
 static const struct drm_connector_helper_funcs mpro_connector_helper_funcs = {
 	.get_modes = mpro_connector_helper_get_modes,
+	.atomic_check = mpro_connector_helper_atomic_check,
 };
 
+static void mpro_connector_reset(struct drm_connector *connector) {
+
+	struct mpro_device *mpro = to_mpro(connector -> dev);
+	struct mpro_connector_state *state;
+	int i;
+
+	if ( connector -> state ) {
+		__drm_atomic_helper_connector_destroy_state(connector -> state);
+		kfree(to_mpro_connector_state(connector -> state));
+		connector -> state = NULL;
+	}
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if ( !state )
+		return;
+
+	for ( i = 0; i < MPRO_TUNE_COUNT; i++ )
+		state -> values[i] = mpro_config_get(mpro, i);
+
+	__drm_atomic_helper_connector_reset(connector, &state -> base);
+}
+
+static struct drm_connector_state *mpro_connector_duplicate_state(struct drm_connector *connector) {
+
+	struct mpro_connector_state *state;
+
+	if ( drm_WARN_ON(connector -> dev, !connector -> state))
+		return NULL;
+
+	state = kmemdup(to_mpro_connector_state(connector -> state), sizeof(*state), GFP_KERNEL);
+	if ( !state )
+		return NULL;
+
+	__drm_atomic_helper_connector_duplicate_state(connector, &state -> base);
+
+	return &state -> base;
+}
+
+static void mpro_connector_destroy_state(struct drm_connector *connector, struct drm_connector_state *state) {
+
+	__drm_atomic_helper_connector_destroy_state(state);
+	kfree(to_mpro_connector_state(state));
+}
+
+static int mpro_connector_set_property(struct drm_connector *connector, struct drm_connector_state *state,
+				       struct drm_property *property, uint64_t val) {
+
+	struct mpro_device *mpro = to_mpro(connector -> dev);
+	int i;
+
+	for ( i = 0; i < MPRO_TUNE_COUNT; i++ ) {
+		if ( property == mpro -> props[i] ) {
+			to_mpro_connector_state(state) -> values[i] = val;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int mpro_connector_get_property(struct drm_connector *connector, const struct drm_connector_state *state,
+				       struct drm_property *property, uint64_t *val) {
+
+	struct mpro_device *mpro = to_mpro(connector -> dev);
+	const struct mpro_connector_state *mstate = container_of(state, struct mpro_connector_state, base);
+	int i;
+
+	for ( i = 0; i < MPRO_TUNE_COUNT; i++ ) {
+		if ( property == mpro -> props[i] ) {
+			*val = mstate -> values[i];
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
 static const struct drm_connector_funcs mpro_connector_funcs = {
-	.reset = drm_atomic_helper_connector_reset,
+	.reset = mpro_connector_reset,
 	.fill_modes = drm_helper_probe_single_connector_modes,
 	.destroy = drm_connector_cleanup,
-	.atomic_duplicate_state = drm_atomic_helper_connector_duplicate_state,
-	.atomic_destroy_state = drm_atomic_helper_connector_destroy_state,
+	.atomic_duplicate_state = mpro_connector_duplicate_state,
+	.atomic_destroy_state = mpro_connector_destroy_state,
+	.atomic_set_property = mpro_connector_set_property,
+	.atomic_get_property = mpro_connector_get_property,
 };
 
+/*
+ * Tunables changed through connector properties are applied before the
+ * planes are updated, so they take effect with the commit that set them.
+ * Only values that changed are written, sysfs writes in between stay.
+ *
+ * Unlike drm_atomic_helper_commit_tail() this does not wait for vblank:
+ * ticks are held back until the frame is on the panel, which on a busy
+ * link takes longer than the helper waits, and the commit returns once
+ * the frame is queued. Planes can be cleaned up right away, the plane
+ * update copied the framebuffer or holds references to its pages.
+ */
+void mpro_atomic_commit_tail(struct drm_atomic_state *state) {
+
+	struct drm_device *dev = state -> dev;
+	struct drm_connector_state *old_state, *new_state;
+	struct drm_connector *connector;
+	int i, j;
+
+	for_each_oldnew_connector_in_state(state, connector, old_state, new_state, i) {
+
+		struct mpro_device *mpro = to_mpro(connector -> dev);
+		struct mpro_connector_state *old = to_mpro_connector_state(old_state);
+		struct mpro_connector_state *new = to_mpro_connector_state(new_state);
+
+		// checked in atomic_check already
+		for ( j = 0; j < MPRO_TUNE_COUNT; j++ )
+			if ( new -> values[j] != old -> values[j] )
+				mpro_config_set(mpro, j, new -> values[j]);
+	}
+
+	drm_atomic_helper_commit_modeset_disables(dev, state);
+	drm_atomic_helper_commit_planes(dev, state, 0);
+	drm_atomic_helper_commit_modeset_enables(dev, state);
+	drm_atomic_helper_commit_hw_done(state);
+	drm_atomic_helper_cleanup_planes(dev, state);
+}
+
+/*
+ * A sysfs write bypasses the atomic state, the current connector state is
+ * brought up to date so property reads and the next commit see the value
+ * written, instead of writing the stale one back.
+ */
+void mpro_connector_sync(struct mpro_device *mpro, enum mpro_tunable tunable) {
+
+	struct drm_device *dev = &mpro -> dev;
+	struct drm_connector *connector = &mpro -> connector;
+
+	drm_modeset_lock(&dev -> mode_config.connection_mutex, NULL);
+
+	if ( connector -> state )
+		to_mpro_connector_state(connector -> state) -> values[tunable] = mpro_config_get(mpro, tunable);
+
+	drm_modeset_unlock(&dev -> mode_config.connection_mutex);
+}
+
+static const struct drm_prop_enum_list mpro_partial_names[] = {
+	{ MPRO_PARTIAL_OFF, "off" },
+	{ MPRO_PARTIAL_ON, "on" },
+	{ MPRO_PARTIAL_AUTO, "auto" },
+};
+
+static int mpro_init_properties(struct mpro_device *mpro) {
+
+	struct drm_device *dev = &mpro -> dev;
+	struct drm_property **props = mpro -> props;
+	int i;
+
+	if ( mpro -> config.partial >= 0 )
+		props[MPRO_TUNE_PARTIAL] = drm_property_create_enum(dev, 0, "partial updates",
+								    mpro_partial_names, ARRAY_SIZE(mpro_partial_names));
+	props[MPRO_TUNE_FLIPX] = drm_property_create_bool(dev, 0, "flip x");
+	props[MPRO_TUNE_THRESHOLD] = drm_property_create_range(dev, 0, "damage threshold", 0, 100);
+	props[MPRO_TUNE_CHUNK] = drm_property_create_range(dev, 0, "chunk size", 0, mpro -> block_size);
+	props[MPRO_TUNE_HZ] = drm_property_create_range(dev, 0, "pacing hz", 0, MPRO_HZ_MAX);
+
+	for ( i = 0; i < MPRO_TUNE_COUNT; i++ ) {
+
+		if ( i == MPRO_TUNE_PARTIAL && mpro -> config.partial < 0 )
+			continue;
+
+		if ( !props[i] )
+			return -ENOMEM;
+
+		drm_object_attach_property(&mpro -> connector.base, props[i], mpro_config_get(mpro, i));
+	}
+
+	return 0;
+}
+
 int mpro_init_connector(struct mpro_device* mpro) {
 
 	struct drm_device *dev = &mpro -> dev;
@@ -54,15 +366,27 @@ int mpro_init_connector(struct mpro_device* mpro) {
 	struct drm_encoder *encoder = &mpro -> encoder;
 	struct drm_connector *connector = &mpro -> connector;
 	struct drm_plane *primary_plane = &mpro -> primary_plane;
+	struct drm_plane *cursor_plane = &mpro -> layers[MPRO_LAYER_CURSOR].plane;
 	int ret;
 
-	ret = drm_crtc_init_with_planes(dev, crtc, primary_plane, NULL,
+	ret = drm_crtc_init_with_planes(dev, crtc, primary_plane, cursor_plane,
 					&mpro_crtc_funcs, NULL);
 	if ( ret )
 		return ret;
 
 	drm_crtc_helper_add(crtc, &mpro_crtc_helper_funcs);
 
+	hrtimer_init(&mpro -> vblank_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	mpro -> vblank_timer.function = mpro_vblank_timer;
+
+	ret = drmm_add_action_or_reset(dev, mpro_vblank_release, NULL);
+	if ( ret )
+		return ret;
+
+	ret = drm_vblank_init(dev, 1);
+	if ( ret )
+		return ret;
+
 	/* Encoder */
 
 	// DRM_MODE_ENCODER_NONE or DRM_MODE_ENCODER_VIRTUAL?
@@ -85,5 +409,9 @@ int mpro_init_connector(struct mpro_device* mpro) {
 						       DRM_MODE_PANEL_ORIENTATION_UNKNOWN,
 						       mpro -> info.width, mpro -> info.height);
 
+	ret = mpro_init_properties(mpro);
+	if ( ret )
+		return ret;
+
 	return drm_connector_attach_encoder(connector, encoder);
 }
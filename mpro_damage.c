@@ -0,0 +1,362 @@
+/* SPDX-License-Identifier: MIT */
+#include <linux/math64.h>
+#include <drm/drm_print.h>
+#include <drm/drm_rect.h>
+#include "mpro.h"
+
+/*
+ * Damage optimizer. Every partial update costs a control message round
+ * trip on top of the pixels it moves, so small neighbouring clips are
+ * cheaper to send as one rect, and overlapping clips should not send
+ * the same pixels twice. Costs are expressed in bytes: a draw command
+ * is worth config.cmd_cost bytes of bulk payload.
+ */
+
+/*
+ * Price of one draw command in bulk bytes. In adaptive mode it is what
+ * the link could have moved during a measured cmd_draw round trip.
+ */
+u64 mpro_cmd_cost(struct mpro_device *mpro) {
+
+	u64 ctrl_ns = READ_ONCE(mpro -> ctrl_ns);
+	u64 rate = READ_ONCE(mpro -> rate);
+
+	if ( mpro -> config.partial != MPRO_PARTIAL_AUTO || !ctrl_ns || !rate )
+		return mpro -> config.cmd_cost;
+
+	return div64_u64(ctrl_ns * rate, NSEC_PER_SEC);
+}
+
+static u64 mpro_damage_cost(struct mpro_device *mpro, const struct drm_rect *r) {
+
+	return mpro_cmd_cost(mpro) + (u64)drm_rect_width(r) * drm_rect_height(r) * MPRO_BPP / 8;
+}
+
+/*
+ * Adaptive mode: compare the partial rects against one full update,
+ * with a hysteresis band so that damage hovering around the break even
+ * point doesn't flip the choice every frame.
+ */
+static bool mpro_damage_policy(struct mpro_device *mpro, u64 cost) {
+
+	u64 full = mpro_cmd_cost(mpro) + mpro -> block_size;
+	unsigned int limit = mpro -> policy_full ? MPRO_POLICY_LOW : MPRO_POLICY_HIGH;
+	bool decision = cost * 100 >= full * limit;
+
+	if ( decision != mpro -> policy_full ) {
+		mpro -> policy_full = decision;
+		mpro_perf_add(mpro, MPRO_PERF_SWITCHES, 1);
+	}
+
+	return decision;
+}
+
+static bool mpro_rect_contains(const struct drm_rect *a, const struct drm_rect *b) {
+
+	return b -> x1 >= a -> x1 && b -> x2 <= a -> x2 && b -> y1 >= a -> y1 && b -> y2 <= a -> y2;
+}
+
+static bool mpro_rect_overlaps(const struct drm_rect *a, const struct drm_rect *b) {
+
+	return a -> x1 < b -> x2 && b -> x1 < a -> x2 && a -> y1 < b -> y2 && b -> y1 < a -> y2;
+}
+
+static void mpro_damage_remove(struct mpro_damage *d, unsigned int i) {
+
+	d -> rects[i] = d -> rects[--d -> nrects];
+}
+
+/*
+ * Cut the part of b covered by a. Works when a spans b completely in
+ * one direction; if a sits in the middle of b, b is split in two and
+ * the second half is returned in extra. Returns number of pieces left
+ * of b, 0 when it could not be cut.
+ */
+static int mpro_damage_trim(const struct drm_rect *a, struct drm_rect *b, struct drm_rect *extra) {
+
+	if ( b -> x1 >= a -> x1 && b -> x2 <= a -> x2 ) {
+
+		if ( b -> y1 < a -> y1 && b -> y2 > a -> y2 ) {
+			*extra = DRM_RECT_INIT(b -> x1, a -> y2, drm_rect_width(b), b -> y2 - a -> y2);
+			b -> y2 = a -> y1;
+			return 2;
+		}
+
+		if ( b -> y1 >= a -> y1 )
+			b -> y1 = a -> y2;
+		else
+			b -> y2 = a -> y1;
+
+		return 1;
+
+	} else if ( b -> y1 >= a -> y1 && b -> y2 <= a -> y2 ) {
+
+		if ( b -> x1 < a -> x1 && b -> x2 > a -> x2 ) {
+			*extra = DRM_RECT_INIT(a -> x2, b -> y1, b -> x2 - a -> x2, drm_rect_height(b));
+			b -> x2 = a -> x1;
+			return 2;
+		}
+
+		if ( b -> x1 >= a -> x1 )
+			b -> x1 = a -> x2;
+		else
+			b -> x2 = a -> x1;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Drop rects covered by others and cut overlaps that can be cut cleanly */
+static void mpro_damage_dedup(struct mpro_device *mpro, struct mpro_damage *d) {
+
+	struct drm_rect extra;
+	unsigned int i, j;
+
+	for ( i = 0; i < d -> nrects; i++ ) {
+		for ( j = 0; j < d -> nrects; j++ ) {
+
+			if ( i == j || !mpro_rect_overlaps(&d -> rects[i], &d -> rects[j]))
+				continue;
+
+			if ( mpro_rect_contains(&d -> rects[i], &d -> rects[j])) {
+				mpro_damage_remove(d, j);
+				if ( i == d -> nrects )
+					i = j;
+				j = -1;
+				continue;
+			}
+
+			switch ( mpro_damage_trim(&d -> rects[i], &d -> rects[j], &extra)) {
+			case 2:
+				if ( d -> nrects < MPRO_MAX_CLIPS ) {
+					d -> rects[d -> nrects++] = extra;
+					mpro_perf_add(mpro, MPRO_PERF_SPLITS, 1);
+				} else
+					mpro_rect_union(&d -> rects[j], &extra);
+				break;
+			case 1:
+				mpro_perf_add(mpro, MPRO_PERF_TRIMS, 1);
+				break;
+			}
+		}
+	}
+}
+
+static u64 mpro_rect_area(const struct drm_rect *r) {
+
+	return (u64)drm_rect_width(r) * drm_rect_height(r);
+}
+
+/*
+ * Bounding box pre-pass, linear per rect: while there are more rects than
+ * draw commands, the last one goes into the rect it grows least. Keeps
+ * the pairwise merge below to a handful of rects.
+ */
+static void mpro_damage_reduce(struct mpro_device *mpro, struct mpro_damage *d) {
+
+	while ( d -> nrects > MPRO_MAX_CMDS ) {
+
+		const struct drm_rect *last = &d -> rects[d -> nrects - 1];
+		u64 grow, best = U64_MAX;
+		unsigned int i, bi = 0;
+		struct drm_rect u;
+
+		for ( i = 0; i + 1 < d -> nrects; i++ ) {
+
+			u = d -> rects[i];
+			mpro_rect_union(&u, last);
+			grow = mpro_rect_area(&u) - mpro_rect_area(&d -> rects[i]);
+
+			if ( grow < best ) {
+				best = grow;
+				bi = i;
+			}
+		}
+
+		mpro_rect_union(&d -> rects[bi], last);
+		d -> nrects--;
+		mpro_perf_add(mpro, MPRO_PERF_MERGES, 1);
+	}
+}
+
+/*
+ * Greedily merge the pair with the best saving until nothing pays off.
+ * Splits by dedup can add rects back, so passes are bounded and what is
+ * left over the command limit goes through the pre-pass again.
+ */
+static void mpro_damage_merge(struct mpro_device *mpro, struct mpro_damage *d) {
+
+	unsigned int passes = 0;
+
+	while ( d -> nrects > 1 && passes++ < MPRO_MERGE_PASSES ) {
+
+		s64 best_gain = S64_MIN;
+		unsigned int i, j, bi = 0, bj = 0;
+		bool forced = d -> nrects > MPRO_MAX_CMDS;
+		struct drm_rect u;
+
+		for ( i = 0; i < d -> nrects; i++ ) {
+			for ( j = i + 1; j < d -> nrects; j++ ) {
+
+				s64 gain;
+
+				u = d -> rects[i];
+				mpro_rect_union(&u, &d -> rects[j]);
+				gain = (s64)(mpro_damage_cost(mpro, &d -> rects[i]) + mpro_damage_cost(mpro, &d -> rects[j])) -
+					(s64)mpro_damage_cost(mpro, &u);
+
+				if ( gain > best_gain ) {
+					best_gain = gain;
+					bi = i;
+					bj = j;
+				}
+			}
+		}
+
+		if ( best_gain < 0 && !forced )
+			break;
+
+		mpro_rect_union(&d -> rects[bi], &d -> rects[bj]);
+		mpro_damage_remove(d, bj);
+		mpro_perf_add(mpro, MPRO_PERF_MERGES, 1);
+
+		mpro_damage_dedup(mpro, d);
+	}
+
+	mpro_damage_reduce(mpro, d);
+}
+
+void mpro_damage_init(struct mpro_damage *d) {
+
+	d -> nrects = 0;
+	d -> full = false;
+	d -> pixels = 0;
+}
+
+/* Add a clip in panel coordinates, aligned to the configured pixel boundary */
+void mpro_damage_add(struct mpro_device *mpro, struct mpro_damage *d, const struct drm_rect *clip) {
+
+	unsigned int align = max_t(unsigned int, mpro -> config.align, 1);
+	struct drm_rect r = *clip;
+
+	if ( !drm_rect_intersect(&r, &mpro -> info.rect))
+		return;
+
+	d -> pixels += drm_rect_width(&r) * drm_rect_height(&r);
+
+	r.x1 = rounddown(r.x1, align);
+	r.x2 = min_t(int, roundup(r.x2, align), mpro -> info.width);
+
+	if ( d -> nrects == MPRO_MAX_CLIPS ) {
+		mpro_rect_union(&d -> rects[d -> nrects - 1], &r);
+		return;
+	}
+
+	d -> rects[d -> nrects++] = r;
+}
+
+/*
+ * Reduce the clip list to the cheapest set of rects to send. Sets
+ * d -> full when one full frame update costs less or the damaged area
+ * passes config.threshold percent of the panel; rects still tell the
+ * caller which pixels have to be converted.
+ */
+void mpro_damage_optimize(struct mpro_device *mpro, struct mpro_damage *d) {
+
+	struct drm_rect full = mpro -> info.rect;
+	unsigned int nclips = d -> nrects;
+	u64 area = 0, cost = 0;
+	unsigned int i;
+
+	if ( !d -> nrects )
+		return;
+
+	mpro_damage_reduce(mpro, d);
+	mpro_damage_dedup(mpro, d);
+	mpro_damage_merge(mpro, d);
+
+	for ( i = 0; i < d -> nrects; i++ ) {
+		area += (u64)drm_rect_width(&d -> rects[i]) * drm_rect_height(&d -> rects[i]);
+		cost += mpro_damage_cost(mpro, &d -> rects[i]);
+	}
+
+	if ( mpro -> config.partial == MPRO_PARTIAL_AUTO )
+		d -> full = mpro_damage_policy(mpro, cost);
+	else if ( cost >= mpro_damage_cost(mpro, &full) ||
+		  area * 100 >= (u64)mpro -> config.threshold * mpro -> info.width * mpro -> info.height )
+		d -> full = true;
+
+	// damage and sent pixels are counted where clips are added and blitted
+	mpro_perf_add(mpro, MPRO_PERF_CLIPS, nclips);
+	mpro_perf_add(mpro, MPRO_PERF_RECTS, d -> full ? 1 : d -> nrects);
+	if ( d -> full )
+		mpro_perf_add(mpro, MPRO_PERF_FULL_FRAMES, 1);
+
+	drm_dbg(&mpro -> dev, "damage: %u clips -> %u rects, %llu/%u pixels%s\n",
+		nclips, d -> nrects, area, mpro -> info.width * mpro -> info.height,
+		d -> full ? ", full frame" : "");
+}
+
+/* first and last differing pixel of two lines known to differ */
+static void mpro_damage_span(const u16 *a, const u16 *b, unsigned int pixels, unsigned int *first, unsigned int *last) {
+
+	unsigned int x1 = 0, x2 = pixels;
+
+	while ( x1 < pixels && a[x1] == b[x1] )
+		x1++;
+
+	while ( x2 > x1 && a[x2 - 1] == b[x2 - 1] )
+		x2--;
+
+	*first = x1;
+	*last = x2;
+}
+
+/*
+ * Dirty mode: src holds the freshly converted pixels of rect, packed
+ * line after line, dst is the frame that was sent last. Lines that
+ * differ are copied to dst and every band of MPRO_DIRTY_LINES lines
+ * contributes the bounding box of its changes to d.
+ */
+void mpro_damage_diff(struct mpro_device *mpro, struct mpro_damage *d, unsigned char *dst,
+		      const unsigned char *src, const struct drm_rect *rect) {
+
+	unsigned int width = drm_rect_width(rect);
+	unsigned int linelen = width * MPRO_BPP / 8;
+	int y, band;
+
+	dst += rect -> y1 * mpro -> pitch + rect -> x1 * MPRO_BPP / 8;
+
+	for ( band = rect -> y1; band < rect -> y2; band += MPRO_DIRTY_LINES ) {
+
+		int end = min(band + MPRO_DIRTY_LINES, rect -> y2);
+		struct drm_rect changed = { };
+
+		for ( y = band; y < end; y++ ) {
+
+			unsigned int x1, x2;
+
+			if ( memcmp(dst, src, linelen )) {
+
+				mpro_damage_span((const u16 *)dst, (const u16 *)src, width, &x1, &x2);
+				memcpy(dst + x1 * MPRO_BPP / 8, src + x1 * MPRO_BPP / 8, (x2 - x1) * MPRO_BPP / 8);
+
+				if ( !drm_rect_visible(&changed))
+					changed = DRM_RECT_INIT(rect -> x1 + x1, y, x2 - x1, 1);
+				else {
+					changed.x1 = min_t(int, changed.x1, rect -> x1 + x1);
+					changed.x2 = max_t(int, changed.x2, rect -> x1 + x2);
+					changed.y2 = y + 1;
+				}
+			}
+
+			dst += mpro -> pitch;
+			src += linelen;
+		}
+
+		if ( drm_rect_visible(&changed))
+			mpro_damage_add(mpro, d, &changed);
+	}
+}
@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: MIT */
+#include <linux/debugfs.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <drm/drm_debugfs.h>
+#include <drm/drm_file.h>
+#include <drm/drm_managed.h>
+#include "mpro.h"
+
+/*
+ * Performance counters live in per cpu slots, the update path and the
+ * completion handlers only ever touch their own cpu's copy. Readers sum
+ * the slots; reset clears them without stopping the writers, so an
+ * update racing with it may survive or get lost.
+ */
+
+static const char * const mpro_perf_counter_names[MPRO_PERF_COUNTERS] = {
+	[MPRO_PERF_FRAMES] = "frames",
+	[MPRO_PERF_PARTIAL_BLITS] = "partial_blits",
+	[MPRO_PERF_FULL_BLITS] = "full_blits",
+	[MPRO_PERF_BYTES] = "bytes_sent",
+	[MPRO_PERF_DAMAGE_PIXELS] = "damage_pixels",
+	[MPRO_PERF_SENT_PIXELS] = "sent_pixels",
+	[MPRO_PERF_USB_ERRORS] = "usb_errors",
+	[MPRO_PERF_TIMEOUTS] = "timeouts",
+	[MPRO_PERF_RETRIES] = "retries",
+	[MPRO_PERF_CLIPS] = "damage_clips",
+	[MPRO_PERF_RECTS] = "damage_rects",
+	[MPRO_PERF_MERGES] = "merges",
+	[MPRO_PERF_TRIMS] = "trims",
+	[MPRO_PERF_SPLITS] = "splits",
+	[MPRO_PERF_FULL_FRAMES] = "full_frames",
+	[MPRO_PERF_UNCHANGED] = "unchanged",
+	[MPRO_PERF_SWITCHES] = "policy_switches",
+	[MPRO_PERF_COALESCED] = "coalesced",
+	[MPRO_PERF_DROPPED] = "dropped",
+};
+
+static const char * const mpro_perf_latency_names[MPRO_LAT_COUNT] = {
+	[MPRO_LAT_CONVERT] = "convert",
+	[MPRO_LAT_CTRL] = "control",
+	[MPRO_LAT_BULK] = "bulk",
+	[MPRO_LAT_COMMIT] = "commit",
+};
+
+static void mpro_perf_release(struct drm_device *dev, void *res) {
+
+	struct mpro_device *mpro = to_mpro(dev);
+
+	free_percpu(mpro -> perf);
+}
+
+int mpro_perf_init(struct mpro_device *mpro) {
+
+	mpro -> perf = alloc_percpu(struct mpro_perf);
+	if ( !mpro -> perf )
+		return -ENOMEM;
+
+	return drmm_add_action_or_reset(&mpro -> dev, mpro_perf_release, NULL);
+}
+
+static void mpro_perf_sum(struct mpro_device *mpro, struct mpro_perf *sum) {
+
+	int cpu, i, j;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+
+		struct mpro_perf *perf = per_cpu_ptr(mpro -> perf, cpu);
+
+		for ( i = 0; i < MPRO_PERF_COUNTERS; i++ )
+			sum -> counters[i] += READ_ONCE(perf -> counters[i]);
+
+		for ( i = 0; i < MPRO_LAT_COUNT; i++ )
+			for ( j = 0; j < MPRO_HIST_BUCKETS; j++ )
+				sum -> hist[i][j] += READ_ONCE(perf -> hist[i][j]);
+	}
+}
+
+static int mpro_stats_show(struct seq_file *m, void *data) {
+
+	struct mpro_device *mpro = m -> private;
+	struct mpro_perf *sum;
+	int i, j;
+
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if ( !sum )
+		return -ENOMEM;
+
+	mpro_perf_sum(mpro, sum);
+
+	for ( i = 0; i < MPRO_PERF_COUNTERS; i++ )
+		seq_printf(m, "%s: %llu\n", mpro_perf_counter_names[i], sum -> counters[i]);
+
+	// link estimates the cost model works with, not reset with the counters
+	seq_printf(m, "ctrl_ns: %llu\nrate: %llu\ncmd_cost: %llu\n",
+		   READ_ONCE(mpro -> ctrl_ns), READ_ONCE(mpro -> rate), mpro_cmd_cost(mpro));
+
+	for ( i = 0; i < MPRO_LAT_COUNT; i++ ) {
+
+		seq_printf(m, "\n%s latency (us):\n", mpro_perf_latency_names[i]);
+
+		for ( j = 0; j < MPRO_HIST_BUCKETS; j++ ) {
+
+			if ( !sum -> hist[i][j] )
+				continue;
+
+			if ( j == MPRO_HIST_BUCKETS - 1 )
+				seq_printf(m, "  %8lu+        : %llu\n", 1UL << (j - 1), sum -> hist[i][j]);
+			else
+				seq_printf(m, "  %8lu - %-8lu: %llu\n", j ? 1UL << (j - 1) : 0, (1UL << j) - 1, sum -> hist[i][j]);
+		}
+	}
+
+	kfree(sum);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mpro_stats);
+
+static ssize_t mpro_reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+
+	struct mpro_device *mpro = file -> private_data;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(mpro -> perf, cpu), 0, sizeof(struct mpro_perf));
+
+	return count;
+}
+
+static const struct file_operations mpro_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = mpro_reset_write,
+	.llseek = noop_llseek,
+};
+
+void mpro_debugfs_init(struct drm_minor *minor) {
+
+	struct mpro_device *mpro = to_mpro(minor -> dev);
+	struct dentry *root = debugfs_create_dir("mpro", minor -> debugfs_root);
+
+	debugfs_create_file("stats", 0444, root, mpro, &mpro_stats_fops);
+	debugfs_create_file("reset", 0200, root, mpro, &mpro_reset_fops);
+}
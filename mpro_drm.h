@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: MIT */
+#ifndef _MPRO_DRM_H_
+#define _MPRO_DRM_H_
+
+#include <drm/drm.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+ * Driver private ioctls of mpro.
+ *
+ * DRM_IOCTL_MPRO_FLUSH sends rects of a pre-rendered RGB565 buffer to the
+ * panel without an atomic commit. The buffer is a dumb buffer laid out
+ * like the panel: pixel (x, y) is at y * pitch + x * 2 and the flipx
+ * option is not applied to it. It stays mapped in the driver after the
+ * first flush, later flushes of the same handle cost a copy of the rects
+ * and their usb transfer only.
+ *
+ * Ordering: flushes and plane updates of atomic commits are serialized,
+ * a flush reaches the panel after every commit whose plane update ran
+ * before the ioctl and before every later one. Flushed pixels stay on
+ * the panel until a later commit damages them; planes above the primary
+ * one, such as the cursor, are composited over flushed rects as well.
+ *
+ * Rects are widened to even x coordinates, the buffer must hold valid
+ * pixels there too. With MPRO_FLUSH_OUT_FENCE a sync_file fd is returned
+ * in fence_fd, it signals once the rects are on the panel, with an error
+ * if the transfer failed.
+ *
+ * After a commit that sent an RGB565 framebuffer directly, the driver
+ * lacks its pixels until the next commit. A flush that would need a full
+ * frame update then fails with -EBUSY and sends nothing of its rects.
+ */
+
+#define DRM_MPRO_FLUSH		0x00
+
+#define MPRO_FLUSH_OUT_FENCE	(1 << 0)
+#define MPRO_FLUSH_FLAGS	MPRO_FLUSH_OUT_FENCE
+
+struct drm_mpro_rect {
+	__u32 x;
+	__u32 y;
+	__u32 width;
+	__u32 height;
+};
+
+struct drm_mpro_flush {
+	__u32 handle;		/* gem handle of the RGB565 buffer */
+	__u32 pitch;		/* bytes per line of the buffer */
+	__u64 rects;		/* user pointer to num_rects struct drm_mpro_rect */
+	__u32 num_rects;	/* 1 to 16 */
+	__u32 flags;		/* MPRO_FLUSH_* */
+	__s32 fence_fd;		/* out, with MPRO_FLUSH_OUT_FENCE */
+	__u32 pad;
+};
+
+#define DRM_IOCTL_MPRO_FLUSH	DRM_IOWR(DRM_COMMAND_BASE + DRM_MPRO_FLUSH, struct drm_mpro_flush)
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _MPRO_DRM_H_ */
@@ -1,7 +1,9 @@
 /* SPDX-License-Identifier: MIT */
 #include <linux/module.h>
 #include <linux/platform_device.h>
+#include <linux/pm_runtime.h>
 #include <linux/usb.h>
+#include <linux/version.h>
 #include <drm/drm_atomic.h>
 #include <drm/drm_device.h>
 #include <drm/drm_drv.h>
@@ -11,18 +13,35 @@
 #include <drm/drm_gem_framebuffer_helper.h>
 #include <drm/drm_gem_shmem_helper.h>
 #include <drm/drm_managed.h>
+#include <drm/drm_modeset_helper.h>
 #include <drm/drm_print.h>
 #include "mpro.h"
+#include "mpro_drm.h"
+
+#define CREATE_TRACE_POINTS
+#include "mpro_trace.h"
 
 #define DRIVER_NAME	"mpro"
 #define DRIVER_DESC	"DRM driver for VoCore Screen"
 #define DRIVER_DATE	"20240505"
 #define DRIVER_MAJOR	1
-#define DRIVER_MINOR	0
+#define DRIVER_MINOR	1
 
 static int partial = 0;
 module_param(partial, int, 0660);
-MODULE_PARM_DESC(partial, "set partial to 1 to enable partial screen updates");
+MODULE_PARM_DESC(partial, "set partial to 1 to enable partial screen updates, 2 to choose per frame from measured link costs");
+
+static int dirty = 0;
+module_param(dirty, int, 0660);
+MODULE_PARM_DESC(dirty, "set dirty to 1 to send only pixels that changed since the previous frame");
+
+static int stream = 0;
+module_param(stream, int, 0660);
+MODULE_PARM_DESC(stream, "set stream to 1 to send full frames while they are converted");
+
+static int autosuspend = -1;
+module_param(autosuspend, int, 0660);
+MODULE_PARM_DESC(autosuspend, "autosuspend the panel after this many idle milliseconds and skip repeated frames, -1 leaves usb power policy alone");
 
 static int flipx = 0;
 module_param(flipx, int, 0660);
@@ -30,16 +49,127 @@ MODULE_PARM_DESC(flipx, "set flipx to 1 to flip image on x axis");
 
 static int mpro_data_alloc(struct mpro_device *mpro) {
 
-	unsigned int block_size = mpro -> info.height * mpro -> info.width * MPRO_BPP / 8 + mpro -> info.margin;
+	int ret;
+
+	mpro -> block_size = mpro -> info.height * mpro -> info.width * MPRO_BPP / 8 + mpro -> info.margin;
+
+	ret = mpro_perf_init(mpro);
+	if ( ret )
+		return ret;
+
+	ret = mpro_conv_init(mpro);
+	if ( ret )
+		return ret;
+
+	// dirty mode compares every commit, suppression only repeated ones
+	if ( mpro -> config.dirty || mpro -> config.suppress ) {
+		mpro -> conv = drmm_kmalloc(&mpro -> dev, mpro -> block_size, GFP_KERNEL);
+		if ( !mpro -> conv )
+			return -ENOMEM;
+	}
+
+	/* staging buffers and urbs */
+	ret = mpro_urb_init(mpro);
+	if ( ret )
+		return ret;
 
-	mpro -> data = drmm_kmalloc(&mpro -> dev, PAGE_ALIGN(block_size), GFP_KERNEL);
-	if ( !mpro -> data )
-		return -ENOMEM;
+	return mpro_flush_init(mpro);
+}
+
+/*
+ * Range check of a tunable value, shared by sysfs writes and the atomic
+ * check of connector properties. Chunk sizes are rounded down to what
+ * the transfer uses, value is updated in place.
+ */
+int mpro_config_check(struct mpro_device *mpro, enum mpro_tunable tunable, unsigned int *value) {
+
+	switch ( tunable ) {
+	case MPRO_TUNE_PARTIAL:
+		if ( mpro -> config.partial < 0 )
+			return -EOPNOTSUPP;
+		return *value > MPRO_PARTIAL_AUTO ? -EINVAL : 0;
+	case MPRO_TUNE_FLIPX:
+		*value = !!*value;
+		return 0;
+	case MPRO_TUNE_THRESHOLD:
+		return *value > 100 ? -EINVAL : 0;
+	case MPRO_TUNE_CHUNK:
+		if ( *value && *value < MPRO_CHUNK_ALIGN )
+			return -EINVAL;
+		*value = rounddown(*value, MPRO_CHUNK_ALIGN);
+		return 0;
+	case MPRO_TUNE_HZ:
+		return *value > MPRO_HZ_MAX ? -EINVAL : 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * Runtime tunables, written from sysfs and from connector properties.
+ * config_lock is held by the plane update for the whole commit, so a
+ * new value takes effect with the next commit, never halfway through.
+ */
+int mpro_config_set(struct mpro_device *mpro, enum mpro_tunable tunable, unsigned int value) {
+
+	struct mpro_config *config = &mpro -> config;
+	int ret;
+
+	ret = mpro_config_check(mpro, tunable, &value);
+	if ( ret )
+		return ret;
+
+	mutex_lock(&mpro -> config_lock);
+
+	switch ( tunable ) {
+	case MPRO_TUNE_PARTIAL:
+		if ( config -> partial != value ) {
+			config -> partial = value;
+			mpro -> policy_full = false;
+		}
+		break;
+	case MPRO_TUNE_FLIPX:
+		if ( config -> flipx != value ) {
+			config -> flipx = value;
+			mpro -> redraw = true;
+		}
+		break;
+	case MPRO_TUNE_THRESHOLD:
+		config -> threshold = value;
+		break;
+	case MPRO_TUNE_CHUNK:
+		config -> chunk = value;
+		break;
+	case MPRO_TUNE_HZ:
+		WRITE_ONCE(config -> hz, value);
+		break;
+	default:
+		break;
+	}
+
+	mutex_unlock(&mpro -> config_lock);
 
-	mpro -> block_size = block_size;
 	return 0;
 }
 
+unsigned int mpro_config_get(struct mpro_device *mpro, enum mpro_tunable tunable) {
+
+	switch ( tunable ) {
+	case MPRO_TUNE_PARTIAL:
+		return max_t(int, mpro -> config.partial, 0);
+	case MPRO_TUNE_FLIPX:
+		return mpro -> config.flipx;
+	case MPRO_TUNE_THRESHOLD:
+		return mpro -> config.threshold;
+	case MPRO_TUNE_CHUNK:
+		return mpro -> config.chunk;
+	case MPRO_TUNE_HZ:
+		return READ_ONCE(mpro -> config.hz);
+	default:
+		return 0;
+	}
+}
+
 static struct mpro_device *mpro_device_create(struct drm_driver *drv, struct usb_interface *interface) {
 
 	struct mpro_device *mpro;
@@ -53,7 +183,19 @@ static struct mpro_device *mpro_device_create(struct drm_driver *drv, struct usb
 
 	/* Config */
 	mpro -> config.flipx = flipx == 0 ? 0 : 1;
-	mpro -> config.partial = partial == 0 ? 0 : 1;
+	mpro -> config.partial = clamp(partial, MPRO_PARTIAL_OFF, MPRO_PARTIAL_AUTO);
+	mpro -> config.dirty = dirty == 0 ? 0 : 1;
+	mpro -> config.stream = stream == 0 ? 0 : 1;
+	mpro -> config.suppress = autosuspend < 0 ? 0 : 1;
+	mpro -> config.cmd_cost = MPRO_CMD_COST;
+	mpro -> config.threshold = MPRO_DAMAGE_THRESHOLD;
+	mpro -> config.align = MPRO_DAMAGE_ALIGN;
+	mpro -> config.chunk = MPRO_CHUNK_DEFAULT;
+	mpro -> config.hz = 0;
+
+	ret = drmm_mutex_init(dev, &mpro -> config_lock);
+	if ( ret )
+		return ERR_PTR(ret);
 
 	/* Hardware setup */
 	mpro -> dmadev = usb_intf_get_dma_device(to_usb_interface(dev -> dev));
@@ -67,18 +209,24 @@ static struct mpro_device *mpro_device_create(struct drm_driver *drv, struct usb
 	if ( mpro -> config.flipx )
 		drm_info(dev, "image flip on x axis is enabled");
 
-	if ( mpro -> config.partial > 0 )
+	if ( mpro -> config.partial == MPRO_PARTIAL_AUTO )
+		drm_info(dev, "adaptive partial frame updates enabled");
+	else if ( mpro -> config.partial > 0 )
 		drm_info(dev, "partial frame updates enabled");
 
+	if ( mpro -> config.dirty )
+		drm_info(dev, "unchanged pixels are not sent");
+
+	if ( mpro -> config.stream )
+		drm_info(dev, "full frames are sent while they are converted");
+
+	mpro_select_line_ops(mpro);
+
 	/* Memory management */
 	ret = mpro_data_alloc(mpro);
-	if ( ret )
-		return ERR_PTR(ret);
-
-	iosys_map_set_vaddr(&mpro -> screen_base, mpro -> data);
-	if ( iosys_map_is_null(&mpro -> screen_base)) {
+	if ( ret ) {
 		drm_err(dev, "failed to allocate buffer");
-		return ERR_CAST(mpro);
+		return ERR_PTR(ret);
 	}
 
 	/* Modesetting */
@@ -103,15 +251,23 @@ static struct mpro_device *mpro_device_create(struct drm_driver *drv, struct usb
 
 DEFINE_DRM_GEM_FOPS(mpro_fops);
 
+static const struct drm_ioctl_desc mpro_ioctls[] = {
+	DRM_IOCTL_DEF_DRV(MPRO_FLUSH, mpro_flush_ioctl, DRM_MASTER),
+};
+
 static struct drm_driver mpro_driver = {
 	DRM_GEM_SHMEM_DRIVER_OPS,
+	.gem_prime_import	= mpro_gem_prime_import,
 	.name			= DRIVER_NAME,
 	.desc			= DRIVER_DESC,
 	.date			= DRIVER_DATE,
 	.major			= DRIVER_MAJOR,
 	.minor			= DRIVER_MINOR,
 	.driver_features	= DRIVER_ATOMIC | DRIVER_GEM | DRIVER_MODESET,
+	.ioctls			= mpro_ioctls,
+	.num_ioctls		= ARRAY_SIZE(mpro_ioctls),
 	.fops			= &mpro_fops,
+	.debugfs_init		= mpro_debugfs_init,
 };
 
 static int mpro_probe(struct usb_interface* interface, const struct usb_device_id* id) {
@@ -124,11 +280,26 @@ static int mpro_probe(struct usb_interface* interface, const struct usb_device_i
 	if ( IS_ERR(mpro))
 		return PTR_ERR(mpro);
 
+	dev = &mpro -> dev;
+	usb_set_intfdata(interface, dev);
+
+	if ( autosuspend >= 0 ) {
+		struct usb_device *udev = interface_to_usbdev(interface);
+
+		pm_runtime_set_autosuspend_delay(&udev -> dev, autosuspend);
+		usb_enable_autosuspend(udev);
+		drm_info(dev, "autosuspend after %d ms idle", autosuspend);
+	}
+
 	ret = mpro_init_sysfs(mpro);
 	if ( ret )
 		drm_warn(dev, "failed to add sysfs entries");
 
-	return mpro_fbdev_setup(mpro, MPRO_BPP);
+	ret = mpro_fbdev_setup(mpro, MPRO_BPP);
+	if ( ret )
+		mpro_remove_sysfs(mpro);
+
+	return ret;
 }
 
 static void mpro_remove(struct usb_interface *interface) {
@@ -136,13 +307,57 @@ static void mpro_remove(struct usb_interface *interface) {
 	struct drm_device *dev = usb_get_intfdata(interface);
 	struct mpro_device *mpro = to_mpro(dev);
 
+	mpro_remove_sysfs(mpro);
 	drm_dev_unplug(dev);
-	drm_dev_unregister(dev);
+	mpro_urb_stop(mpro);
 	drm_atomic_helper_shutdown(dev);
 	put_device(mpro -> dmadev);
 	mpro -> dmadev = NULL;
 }
 
+/*
+ * Runtime suspend only waits for the link to go idle, the pipeline stays
+ * enabled. System suspend disables the pipeline through the helper first
+ * so that no commit reaches a sleeping device, and restores it on resume.
+ */
+static int mpro_suspend(struct usb_interface *interface, pm_message_t message) {
+
+	struct drm_device *dev = usb_get_intfdata(interface);
+	struct mpro_device *mpro = to_mpro(dev);
+	int ret;
+
+	if ( PMSG_IS_AUTO(message))
+		return mpro_urb_suspend(mpro, true);
+
+	ret = drm_mode_config_helper_suspend(dev);
+	if ( ret )
+		return ret;
+
+	ret = mpro_urb_suspend(mpro, false);
+	if ( ret ) {
+		drm_mode_config_helper_resume(dev);
+		return ret;
+	}
+
+	mpro -> sleeping = true;
+	return 0;
+}
+
+static int mpro_resume(struct usb_interface *interface) {
+
+	struct drm_device *dev = usb_get_intfdata(interface);
+	struct mpro_device *mpro = to_mpro(dev);
+
+	mpro_urb_resume(mpro);
+
+	if ( mpro -> sleeping ) {
+		mpro -> sleeping = false;
+		return drm_mode_config_helper_resume(dev);
+	}
+
+	return 0;
+}
+
 static const struct usb_device_id mpro_of_match_table[] = {
 	{ .match_flags = USB_DEVICE_ID_MATCH_DEVICE, .idVendor = 0xc872, .idProduct = 0x1004 },
 	{ },
@@ -153,7 +368,17 @@ static struct usb_driver mpro_usb_driver = {
 	.name = "mpro",
 	.probe = mpro_probe,
 	.disconnect = mpro_remove,
+	.suspend = mpro_suspend,
+	.resume = mpro_resume,
+	.reset_resume = mpro_resume,
+	.supports_autosuspend = 1,
 	.id_table = mpro_of_match_table,
+	/* identification blocks on usb, panels on one hub probe side by side */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#else
+	.drvwrap.driver.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+#endif
 };
 
 module_usb_driver(mpro_usb_driver);
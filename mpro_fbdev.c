@@ -4,15 +4,45 @@
 #include <drm/drm_rect.h>
 #include <linux/usb.h>
 #include "mpro.h"
+#include "mpro_trace.h"
 
-static char cmd_draw[12] = {
+static const char cmd_draw[MPRO_CMD_SIZE] = {
 	0x00, 0x2c, 0x00, 0x00, 0x00, 0x00,
 	0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 };
 
-int mpro_blit(struct mpro_device *mpro, struct drm_rect* rect) {
+/* Copy rect rows out of the frame into a contiguous block as the device expects them */
+static void *mpro_gather(struct mpro_device *mpro, struct mpro_frame *frame, struct drm_rect *rect, unsigned int len) {
 
-	int cmd_len = 6;
+	unsigned int linelen = drm_rect_width(rect) * MPRO_BPP / 8;
+	const unsigned char *src = frame -> data + rect -> y1 * mpro -> pitch + rect -> x1 * MPRO_BPP / 8;
+	unsigned char *dst = frame -> pack + frame -> pack_len;
+	int y;
+
+	if ( frame -> pack_len + len > mpro -> block_size )
+		return NULL;
+
+	for ( y = rect -> y1; y < rect -> y2; y++ ) {
+		memcpy(dst, src, linelen);
+		dst += linelen;
+		src += mpro -> pitch;
+	}
+
+	dst = frame -> pack + frame -> pack_len;
+	frame -> pack_len += len;
+	return dst;
+}
+
+/* Append a draw command for rect to frame, sent on mpro_frame_flush() */
+int mpro_blit(struct mpro_device *mpro, struct mpro_frame *frame, struct drm_rect* rect) {
+
+	struct mpro_cmd *cmd;
+	unsigned char *buf;
+	void *data = NULL;
+
+	// whole frame already queued, nothing to add
+	if ( frame -> ncmds && frame -> cmds[0].data == frame -> data )
+		return 0;
 
 	// partial frame update
 	if ( rect -> x1 != 0 || rect -> y1 != 0 || rect -> x2 != mpro -> info.rect.x2 || rect -> y2 != mpro -> info.rect.y2 ) {
@@ -20,48 +50,100 @@ int mpro_blit(struct mpro_device *mpro, struct drm_rect* rect) {
 		int len = (rect -> x2 - rect -> x1) * (rect -> y2 - rect -> y1) * MPRO_BPP / 8;
 		int width = rect -> x2 - rect -> x1;
 
-		cmd_draw[2] = (char)(len >> 0);
-		cmd_draw[3] = (char)(len >> 8);
-		cmd_draw[4] = (char)(len >> 16);
+		if ( frame -> ncmds < MPRO_MAX_CMDS )
+			data = mpro_gather(mpro, frame, rect, len);
+
+		if ( data ) {
+
+			cmd = &frame -> cmds[frame -> ncmds++];
+			buf = cmd -> buf;
+			memcpy(buf, cmd_draw, MPRO_CMD_SIZE);
+
+			buf[2] = (char)(len >> 0);
+			buf[3] = (char)(len >> 8);
+			buf[4] = (char)(len >> 16);
 
-		cmd_draw[6] = (char)(rect -> x1 >> 0);
-		cmd_draw[7] = (char)(rect -> x1 >> 8);
-		cmd_draw[8] = (char)(rect -> y1 >> 0);
-		cmd_draw[9] = (char)(rect -> y1 >> 8);
-		cmd_draw[10] = (char)(width >> 0);
-		cmd_draw[11] = (char)(width >> 8);
+			buf[6] = (char)(rect -> x1 >> 0);
+			buf[7] = (char)(rect -> x1 >> 8);
+			buf[8] = (char)(rect -> y1 >> 0);
+			buf[9] = (char)(rect -> y1 >> 8);
+			buf[10] = (char)(width >> 0);
+			buf[11] = (char)(width >> 8);
 
-		cmd_len = 12;
+			cmd -> len = 12;
+			cmd -> data = data;
+			cmd -> sgt = NULL;
+			cmd -> size = len;
+			cmd -> rect = *rect;
 
-	} else { // fullscreen frame update
+			trace_mpro_cmd_queue(mpro_minor(mpro), rect, len);
+			return 0;
+		}
 
-		cmd_draw[2] = (char)(mpro -> block_size >> 0);
-		cmd_draw[3] = (char)(mpro -> block_size >> 8);
-		cmd_draw[4] = (char)(mpro -> block_size >> 16);
+		// too many rects, send whole frame instead
 	}
 
-	struct usb_device *udev = mpro_to_usb_device(mpro);
+	// fullscreen frame update
+	frame -> ncmds = 0;
+	frame -> pack_len = 0;
+
+	cmd = &frame -> cmds[frame -> ncmds++];
+	buf = cmd -> buf;
+	memcpy(buf, cmd_draw, MPRO_CMD_SIZE);
+
+	buf[2] = (char)(mpro -> block_size >> 0);
+	buf[3] = (char)(mpro -> block_size >> 8);
+	buf[4] = (char)(mpro -> block_size >> 16);
+
+	cmd -> len = 6;
+	cmd -> data = frame -> data;
+	cmd -> sgt = NULL;
+	cmd -> size = mpro -> block_size;
+	cmd -> rect = mpro -> info.rect;
+
+	trace_mpro_cmd_queue(mpro_minor(mpro), &cmd -> rect, cmd -> size);
+
+	return 0;
+}
+
+/*
+ * Full frame update sent straight from a framebuffer mapping that is
+ * already in device layout; frame -> data is left untouched.
+ */
+int mpro_blit_direct(struct mpro_device *mpro, struct mpro_frame *frame, const void *vaddr) {
+
+	struct mpro_cmd *cmd;
+	unsigned char *buf;
 	int ret;
 
-	/* 0x40 USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE */
-	ret = usb_control_msg(udev, usb_sndctrlpipe(udev, 0), 0xb0, 0x40,
-			      0, 0, cmd_draw, cmd_len,
-			      MPRO_MAX_DELAY);
-	if ( ret < 0 )
+	ret = mpro_frame_map(frame, vaddr, mpro -> block_size);
+	if ( ret )
 		return ret;
 
-	ret = usb_bulk_msg(udev, usb_sndbulkpipe(udev, 0x02), mpro -> data,
-			   mpro ->block_size, NULL, MPRO_MAX_DELAY);
+	frame -> ncmds = 0;
+	frame -> pack_len = 0;
 
-	return ret < 0 ? ret : 0;
+	cmd = &frame -> cmds[frame -> ncmds++];
+	buf = cmd -> buf;
+	memcpy(buf, cmd_draw, MPRO_CMD_SIZE);
+
+	buf[2] = (char)(mpro -> block_size >> 0);
+	buf[3] = (char)(mpro -> block_size >> 8);
+	buf[4] = (char)(mpro -> block_size >> 16);
+
+	cmd -> len = 6;
+	cmd -> data = NULL;
+	cmd -> sgt = &frame -> sgt;
+	cmd -> size = mpro -> block_size;
+	cmd -> rect = mpro -> info.rect;
+
+	trace_mpro_cmd_queue(mpro_minor(mpro), &cmd -> rect, cmd -> size);
+
+	return 0;
 }
 
 int mpro_fbdev_setup(struct mpro_device *mpro, unsigned int preferred_bpp) {
 
-	cmd_draw[2] = (char)(mpro -> block_size >> 0);
-	cmd_draw[3] = (char)(mpro -> block_size >> 8);
-	cmd_draw[4] = (char)(mpro -> block_size >> 16);
-
 	int ret = drm_dev_register(&mpro -> dev, 0);
 	if ( ret )
 		return ret;
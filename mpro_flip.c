@@ -2,31 +2,26 @@
 #include <drm/drm_format_helper.h>
 #include <drm/drm_framebuffer.h>
 #include <drm/drm_fourcc.h>
+#include <drm/drm_gem.h>
 #include <drm/drm_print.h>
 #include <drm/drm_rect.h>
+#include <drm/drm_managed.h>
+#include <linux/cache.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <asm/simd.h>
+#if defined(CONFIG_X86_64)
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#elif defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+#include <asm/cpufeature.h>
+#include <asm/neon.h>
+#endif
 #include "mpro.h"
+#include "mpro_trace.h"
 
 #ifndef DRM_FORMAT_CONV_STATE_INIT
 
-struct drm_format_conv_state {
-	struct {
-		void *mem;
-		size_t size;
-		bool preallocated;
-	} tmp;
-};
-
-#define __DRM_FORMAT_CONV_STATE_INIT(_mem, _size, _preallocated) { \
-		.tmp = { \
-			.mem = (_mem), \
-			.size = (_size), \
-			.preallocated = (_preallocated), \
-		} \
-	}
-
-#define DRM_FORMAT_CONV_STATE_INIT \
-	__DRM_FORMAT_CONV_STATE_INIT(NULL, 0, false)
-
 static void *drm_format_conv_state_reserve(struct drm_format_conv_state *state,
 				    size_t new_size, gfp_t flags) {
 
@@ -47,157 +42,645 @@ static void *drm_format_conv_state_reserve(struct drm_format_conv_state *state,
 out:
 	return state -> tmp.mem;
 }
+#endif
+
+static void drm_fb_xrgb8888_to_rgb565_line(void *dbuf, const void *sbuf, unsigned int pixels) {
+
+	__le16 *dbuf16 = dbuf;
+	const __le32 *sbuf32 = sbuf;
+	unsigned int x;
+	u16 val16;
+	u32 pix;
 
-static unsigned int clip_offset(const struct drm_rect *clip, unsigned int pitch, unsigned int cpp) {
-	return clip -> y1 * pitch + clip -> x1 * cpp;
-}
-
-/* TODO: Make this function work with multi-plane formats. */
-static int __drm_fb_xfrm(void *dst, unsigned long dst_pitch, unsigned long dst_pixsize,
-			 const void *vaddr, const struct drm_framebuffer *fb,
-			 const struct drm_rect *clip, bool vaddr_cached_hint,
-			 struct drm_format_conv_state *state,
-			 void (*xfrm_line)(void *dbuf, const void *sbuf, unsigned int npixels)) {
-
-	unsigned long linepixels = drm_rect_width(clip);
-	unsigned long lines = drm_rect_height(clip);
-	size_t sbuf_len = linepixels * fb -> format -> cpp[0];
-	void *stmp = NULL;
-	unsigned long i;
-	const void *sbuf;
-
-	/*
-	 * Some source buffers, such as DMA memory, use write-combine
-	 * caching, so reads are uncached. Speed up access by fetching
-	 * one line at a time.
-	 */
-	if ( !vaddr_cached_hint ) {
-		stmp = drm_format_conv_state_reserve(state, sbuf_len, GFP_KERNEL);
-		if ( !stmp )
-			return -ENOMEM;
+	for ( x = 0; x < pixels; x++ ) {
+		pix = le32_to_cpu(sbuf32[x]);
+		val16 = ((pix & 0x00F80000) >> 8) |
+			((pix & 0x0000FC00) >> 5) |
+			((pix & 0x000000F8) >> 3);
+		dbuf16[x] = cpu_to_le16(val16);
 	}
+}
+
+static void drm_fb_xrgb8888_to_rgb565_line_flipped(void *dbuf, const void *sbuf, unsigned int pixels) {
+
+	__le16 *dbuf16 = dbuf;
+	const __le32 *sbuf32 = sbuf;
+	unsigned int x;
+	u16 val16;
+	u32 pix;
 
-	if ( !dst_pitch )
-		dst_pitch = drm_rect_width(clip) * dst_pixsize;
-	vaddr += clip_offset(clip, fb -> pitches[0], fb -> format -> cpp[0]);
-
-	for ( i = 0; i < lines; ++i ) {
-		if ( stmp )
-			sbuf = memcpy(stmp, vaddr, sbuf_len);
-		else
-			sbuf = vaddr;
-		xfrm_line(dst, sbuf, linepixels);
-		vaddr += fb -> pitches[0];
-		dst += dst_pitch;
+	for ( x = 0; x < pixels; x++ ) {
+		pix = le32_to_cpu(sbuf32[x]);
+		val16 = ((pix & 0x00F80000) >> 8) |
+			((pix & 0x0000FC00) >> 5) |
+			((pix & 0x000000F8) >> 3);
+		dbuf16[pixels - 1 - x] = cpu_to_le16(val16);
 	}
+}
 
-	return 0;
+static void mpro_rgb565_line(void *dbuf, const void *sbuf, unsigned int pixels) {
+
+	memcpy(dbuf, sbuf, pixels * sizeof(u16));
 }
 
-/* TODO: Make this function work with multi-plane formats. */
-static int __drm_fb_xfrm_toio(void __iomem *dst, unsigned long dst_pitch, unsigned long dst_pixsize,
-			      const void *vaddr, const struct drm_framebuffer *fb,
-			      const struct drm_rect *clip, bool vaddr_cached_hint,
-			      struct drm_format_conv_state *state,
-			      void (*xfrm_line)(void *dbuf, const void *sbuf, unsigned int npixels)) {
-
-	unsigned long linepixels = drm_rect_width(clip);
-	unsigned long lines = drm_rect_height(clip);
-	size_t dbuf_len = linepixels * dst_pixsize;
-	size_t stmp_off = round_up(dbuf_len, ARCH_KMALLOC_MINALIGN); /* for sbuf alignment */
-	size_t sbuf_len = linepixels * fb -> format -> cpp[0];
-	void *stmp = NULL;
-	unsigned long i;
-	const void *sbuf;
-	void *dbuf;
-
-	if ( vaddr_cached_hint ) {
-		dbuf = drm_format_conv_state_reserve(state, dbuf_len, GFP_KERNEL);
-	} else {
-		dbuf = drm_format_conv_state_reserve(state, stmp_off + sbuf_len, GFP_KERNEL);
-		stmp = dbuf + stmp_off;
-	}
-	if ( !dbuf )
-		return -ENOMEM;
+static void mpro_rgb565_line_flipped(void *dbuf, const void *sbuf, unsigned int pixels) {
+
+	const u16 *sbuf16 = sbuf;
+	u16 *dbuf16 = dbuf;
+	unsigned int x;
 
-	if ( !dst_pitch )
-		dst_pitch = linepixels * dst_pixsize;
-	vaddr += clip_offset(clip, fb -> pitches[0], fb -> format -> cpp[0]);
-
-	for ( i = 0; i < lines; ++i ) {
-		if ( stmp )
-			sbuf = memcpy(stmp, vaddr, sbuf_len);
-		else
-			sbuf = vaddr;
-		xfrm_line(dbuf, sbuf, linepixels);
-		memcpy_toio(dst, dbuf, dbuf_len);
-		vaddr += fb -> pitches[0];
-		dst += dst_pitch;
+	for ( x = 0; x < pixels; x++ )
+		dbuf16[pixels - 1 - x] = sbuf16[x];
+}
+
+static void mpro_bgr565_line(void *dbuf, const void *sbuf, unsigned int pixels) {
+
+	__le16 *dbuf16 = dbuf;
+	const __le16 *sbuf16 = sbuf;
+	unsigned int x;
+	u16 pix;
+
+	for ( x = 0; x < pixels; x++ ) {
+		pix = le16_to_cpu(sbuf16[x]);
+		dbuf16[x] = cpu_to_le16((pix >> 11) | (pix & 0x07E0) | (pix << 11));
 	}
+}
 
-	return 0;
+static void mpro_bgr565_line_flipped(void *dbuf, const void *sbuf, unsigned int pixels) {
+
+	__le16 *dbuf16 = dbuf;
+	const __le16 *sbuf16 = sbuf;
+	unsigned int x;
+	u16 pix;
+
+	for ( x = 0; x < pixels; x++ ) {
+		pix = le16_to_cpu(sbuf16[x]);
+		dbuf16[pixels - 1 - x] = cpu_to_le16((pix >> 11) | (pix & 0x07E0) | (pix << 11));
+	}
 }
 
-/* TODO: Make this function work with multi-plane formats. */
-static int drm_fb_xfrm(struct iosys_map *dst,
-		       const unsigned int *dst_pitch, const u8 *dst_pixsize,
-		       const struct iosys_map *src, const struct drm_framebuffer *fb,
-		       const struct drm_rect *clip, bool vaddr_cached_hint,
-		       struct drm_format_conv_state *state,
-		       void (*xfrm_line)(void *dbuf, const void *sbuf, unsigned int npixels)) {
+static inline u16 mpro_xbgr8888_pixel(u32 pix) {
 
-	static const unsigned int default_dst_pitch[DRM_FORMAT_MAX_PLANES] = { 0, 0, 0, 0 };
+	return ((pix & 0x000000F8) << 8) |
+	       ((pix & 0x0000FC00) >> 5) |
+	       ((pix & 0x00F80000) >> 19);
+}
 
-	if ( !dst_pitch )
-		dst_pitch = default_dst_pitch;
+static void mpro_xbgr8888_line(void *dbuf, const void *sbuf, unsigned int pixels) {
 
-	/* TODO: handle src in I/O memory here */
-	if ( dst[0].is_iomem )
-		return __drm_fb_xfrm_toio(dst[0].vaddr_iomem, dst_pitch[0], dst_pixsize[0],
-					  src[0].vaddr, fb, clip, vaddr_cached_hint, state,
-					  xfrm_line);
-	else
-		return __drm_fb_xfrm(dst[0].vaddr, dst_pitch[0], dst_pixsize[0],
-				     src[0].vaddr, fb, clip, vaddr_cached_hint, state,
-				     xfrm_line);
+	__le16 *dbuf16 = dbuf;
+	const __le32 *sbuf32 = sbuf;
+	unsigned int x;
+
+	for ( x = 0; x < pixels; x++ )
+		dbuf16[x] = cpu_to_le16(mpro_xbgr8888_pixel(le32_to_cpu(sbuf32[x])));
 }
 
-static void drm_fb_xrgb8888_to_rgb565_line_flipped(void *dbuf, const void *sbuf, unsigned int pixels) {
+static void mpro_xbgr8888_line_flipped(void *dbuf, const void *sbuf, unsigned int pixels) {
 
 	__le16 *dbuf16 = dbuf;
 	const __le32 *sbuf32 = sbuf;
 	unsigned int x;
-	u16 val16;
-	u32 pix;
 
-	for ( x = 0; x < pixels; x++ ) {
-		pix = le32_to_cpu(sbuf32[x]);
-		val16 = ((pix & 0x00F80000) >> 8) |
-			((pix & 0x0000FC00) >> 5) |
-			((pix & 0x000000F8) >> 3);
-		dbuf16[pixels - 1 - x] = cpu_to_le16(val16);
+	for ( x = 0; x < pixels; x++ )
+		dbuf16[pixels - 1 - x] = cpu_to_le16(mpro_xbgr8888_pixel(le32_to_cpu(sbuf32[x])));
+}
+
+#define MPRO_PACK565(r, g, b) \
+	((((r) & 0xF8) << 8) | (((g) & 0xFC) << 3) | (((b) & 0xF8) >> 3))
+
+/*
+ * 24bpp lines. Pixels are converted one byte at a time until the source
+ * is 32 bit aligned, then four pixels at a time from three aligned
+ * 32 bit loads, so the bulk of the line never does an unaligned access.
+ * rgb888 is b, g, r in memory, bgr888 r, g, b; bgr tells the two apart
+ * and step is the direction the line is written in, both are constant
+ * in every caller.
+ */
+static __always_inline void mpro_888_line(u16 *dbuf, const u8 *sbuf, unsigned int pixels, bool bgr, int step) {
+
+	unsigned int x = 0;
+	u32 w0, w1, w2;
+
+	for ( ; x < pixels && !IS_ALIGNED((unsigned long)sbuf, 4); x++, sbuf += 3, dbuf += step )
+		*dbuf = cpu_to_le16(bgr ? MPRO_PACK565(sbuf[0], sbuf[1], sbuf[2]) :
+					  MPRO_PACK565(sbuf[2], sbuf[1], sbuf[0]));
+
+	for ( ; x + 4 <= pixels; x += 4, sbuf += 12, dbuf += 4 * step ) {
+
+		w0 = le32_to_cpu(((const __le32 *)sbuf)[0]);
+		w1 = le32_to_cpu(((const __le32 *)sbuf)[1]);
+		w2 = le32_to_cpu(((const __le32 *)sbuf)[2]);
+
+		if ( bgr ) {
+			dbuf[0] = cpu_to_le16(MPRO_PACK565(w0, w0 >> 8, w0 >> 16));
+			dbuf[step] = cpu_to_le16(MPRO_PACK565(w0 >> 24, w1, w1 >> 8));
+			dbuf[2 * step] = cpu_to_le16(MPRO_PACK565(w1 >> 16, w1 >> 24, w2));
+			dbuf[3 * step] = cpu_to_le16(MPRO_PACK565(w2 >> 8, w2 >> 16, w2 >> 24));
+		} else {
+			dbuf[0] = cpu_to_le16(MPRO_PACK565(w0 >> 16, w0 >> 8, w0));
+			dbuf[step] = cpu_to_le16(MPRO_PACK565(w1 >> 8, w1, w0 >> 24));
+			dbuf[2 * step] = cpu_to_le16(MPRO_PACK565(w2, w1 >> 24, w1 >> 16));
+			dbuf[3 * step] = cpu_to_le16(MPRO_PACK565(w2 >> 24, w2 >> 16, w2 >> 8));
+		}
+	}
+
+	for ( ; x < pixels; x++, sbuf += 3, dbuf += step )
+		*dbuf = cpu_to_le16(bgr ? MPRO_PACK565(sbuf[0], sbuf[1], sbuf[2]) :
+					  MPRO_PACK565(sbuf[2], sbuf[1], sbuf[0]));
+}
+
+static void mpro_rgb888_line(void *dbuf, const void *sbuf, unsigned int pixels) {
+
+	mpro_888_line(dbuf, sbuf, pixels, false, 1);
+}
+
+static void mpro_rgb888_line_flipped(void *dbuf, const void *sbuf, unsigned int pixels) {
+
+	mpro_888_line((u16 *)dbuf + pixels - 1, sbuf, pixels, false, -1);
+}
+
+static void mpro_bgr888_line(void *dbuf, const void *sbuf, unsigned int pixels) {
+
+	mpro_888_line(dbuf, sbuf, pixels, true, 1);
+}
+
+static void mpro_bgr888_line_flipped(void *dbuf, const void *sbuf, unsigned int pixels) {
+
+	mpro_888_line((u16 *)dbuf + pixels - 1, sbuf, pixels, true, -1);
+}
+
+/*
+ * Row kernels. Every combination of source format, line converter,
+ * transform mode and source caching is its own function, with the
+ * line converter called directly and the caching choice folded at
+ * compile time. Uncached sources (imported, possibly write-combined)
+ * are read one line at a time into tmp first.
+ *
+ * Lines that turn into columns are converted MPRO_TILE at a time into
+ * a strip following the line copy in tmp. Each source column of the
+ * strip is then one run of MPRO_TILE neighbouring panel pixels, so the
+ * panel is written in runs instead of single pixels a line apart.
+ */
+#define MPRO_KERNEL_ROWS(name, line, cached) \
+static void name(const struct mpro_conv_job *job, unsigned int first, unsigned int last, void *tmp) { \
+\
+	const void *vaddr = job -> vaddr + first * job -> src_pitch; \
+	u16 *dbuf = job -> dbuf + (int)first * job -> dv; \
+	unsigned int v; \
+\
+	for ( v = first; v < last; v++ ) { \
+		line(dbuf, (cached) ? vaddr : memcpy(tmp, vaddr, job -> sbuf_len), job -> width); \
+		vaddr += job -> src_pitch; \
+		dbuf += job -> dv; \
+	} \
+}
+
+#define MPRO_KERNEL_COLUMNS(name, line, cached) \
+static void name(const struct mpro_conv_job *job, unsigned int first, unsigned int last, void *tmp) { \
+\
+	u16 *tile = tmp + job -> stmp_len; \
+	unsigned int w = job -> width; \
+	unsigned int u, v, i, n; \
+\
+	for ( v = first; v < last; v += n ) { \
+\
+		const void *vaddr = job -> vaddr + v * job -> src_pitch; \
+\
+		n = min(last - v, (unsigned int)MPRO_TILE); \
+\
+		for ( i = 0; i < n; i++, vaddr += job -> src_pitch ) \
+			line(tile + i * w, (cached) ? vaddr : memcpy(tmp, vaddr, job -> sbuf_len), w); \
+\
+		/* a source column is a run of n neighbouring pixels on the panel */ \
+		for ( u = 0; u < w; u++ ) { \
+\
+			u16 *out = job -> dbuf + (int)u * job -> du + (int)v * job -> dv; \
+\
+			for ( i = 0; i < n; i++, out += job -> dv ) \
+				*out = tile[i * w + u]; \
+		} \
+	} \
+}
+
+#define MPRO_DEFINE_KERNELS(suffix, line, line_flipped) \
+MPRO_KERNEL_ROWS(mpro_rows_##suffix##_cached, line, true) \
+MPRO_KERNEL_ROWS(mpro_rows_##suffix##_uncached, line, false) \
+MPRO_KERNEL_ROWS(mpro_mirrored_##suffix##_cached, line_flipped, true) \
+MPRO_KERNEL_ROWS(mpro_mirrored_##suffix##_uncached, line_flipped, false) \
+MPRO_KERNEL_COLUMNS(mpro_columns_##suffix##_cached, line, true) \
+MPRO_KERNEL_COLUMNS(mpro_columns_##suffix##_uncached, line, false)
+
+#define MPRO_KERNEL_SET(suffix, caching, is_simd, scalar) \
+	{ \
+		.name = #suffix, \
+		.fn = { \
+			[MPRO_XFRM_ROWS] = mpro_rows_##suffix##_##caching, \
+			[MPRO_XFRM_MIRRORED] = mpro_mirrored_##suffix##_##caching, \
+			[MPRO_XFRM_COLUMNS] = mpro_columns_##suffix##_##caching, \
+		}, \
+		.simd = is_simd, \
+		.fallback = scalar, \
+	}
+
+/* [0] for uncached, [1] for cached sources */
+MPRO_DEFINE_KERNELS(rgb565, mpro_rgb565_line, mpro_rgb565_line_flipped)
+static const struct mpro_kernels mpro_kernels_rgb565[2] = {
+	MPRO_KERNEL_SET(rgb565, uncached, false, NULL),
+	MPRO_KERNEL_SET(rgb565, cached, false, NULL),
+};
+
+MPRO_DEFINE_KERNELS(bgr565, mpro_bgr565_line, mpro_bgr565_line_flipped)
+static const struct mpro_kernels mpro_kernels_bgr565[2] = {
+	MPRO_KERNEL_SET(bgr565, uncached, false, NULL),
+	MPRO_KERNEL_SET(bgr565, cached, false, NULL),
+};
+
+MPRO_DEFINE_KERNELS(xbgr8888, mpro_xbgr8888_line, mpro_xbgr8888_line_flipped)
+static const struct mpro_kernels mpro_kernels_xbgr8888[2] = {
+	MPRO_KERNEL_SET(xbgr8888, uncached, false, NULL),
+	MPRO_KERNEL_SET(xbgr8888, cached, false, NULL),
+};
+
+MPRO_DEFINE_KERNELS(rgb888, mpro_rgb888_line, mpro_rgb888_line_flipped)
+static const struct mpro_kernels mpro_kernels_rgb888[2] = {
+	MPRO_KERNEL_SET(rgb888, uncached, false, NULL),
+	MPRO_KERNEL_SET(rgb888, cached, false, NULL),
+};
+
+MPRO_DEFINE_KERNELS(bgr888, mpro_bgr888_line, mpro_bgr888_line_flipped)
+static const struct mpro_kernels mpro_kernels_bgr888[2] = {
+	MPRO_KERNEL_SET(bgr888, uncached, false, NULL),
+	MPRO_KERNEL_SET(bgr888, cached, false, NULL),
+};
+
+MPRO_DEFINE_KERNELS(xrgb8888_scalar, drm_fb_xrgb8888_to_rgb565_line, drm_fb_xrgb8888_to_rgb565_line_flipped)
+static const struct mpro_kernels mpro_kernels_xrgb8888_scalar[2] = {
+	MPRO_KERNEL_SET(xrgb8888_scalar, uncached, false, NULL),
+	MPRO_KERNEL_SET(xrgb8888_scalar, cached, false, NULL),
+};
+
+static const struct mpro_line_ops mpro_line_ops_scalar = {
+	.name = "scalar",
+	.xrgb8888 = mpro_kernels_xrgb8888_scalar,
+};
+
+#if defined(MPRO_SIMD_X86)
+MPRO_DEFINE_KERNELS(xrgb8888_sse2, mpro_xrgb8888_to_rgb565_line_sse2, mpro_xrgb8888_to_rgb565_line_flipped_sse2)
+static const struct mpro_kernels mpro_kernels_xrgb8888_sse2[2] = {
+	MPRO_KERNEL_SET(xrgb8888_sse2, uncached, true, &mpro_kernels_xrgb8888_scalar[0]),
+	MPRO_KERNEL_SET(xrgb8888_sse2, cached, true, &mpro_kernels_xrgb8888_scalar[1]),
+};
+
+MPRO_DEFINE_KERNELS(xrgb8888_avx2, mpro_xrgb8888_to_rgb565_line_avx2, mpro_xrgb8888_to_rgb565_line_flipped_avx2)
+static const struct mpro_kernels mpro_kernels_xrgb8888_avx2[2] = {
+	MPRO_KERNEL_SET(xrgb8888_avx2, uncached, true, &mpro_kernels_xrgb8888_scalar[0]),
+	MPRO_KERNEL_SET(xrgb8888_avx2, cached, true, &mpro_kernels_xrgb8888_scalar[1]),
+};
+
+static const struct mpro_line_ops mpro_line_ops_sse2 = {
+	.name = "sse2",
+	.xrgb8888 = mpro_kernels_xrgb8888_sse2,
+};
+
+static const struct mpro_line_ops mpro_line_ops_avx2 = {
+	.name = "avx2",
+	.xrgb8888 = mpro_kernels_xrgb8888_avx2,
+};
+#elif defined(MPRO_SIMD_NEON)
+MPRO_DEFINE_KERNELS(xrgb8888_neon, mpro_xrgb8888_to_rgb565_line_neon, mpro_xrgb8888_to_rgb565_line_flipped_neon)
+static const struct mpro_kernels mpro_kernels_xrgb8888_neon[2] = {
+	MPRO_KERNEL_SET(xrgb8888_neon, uncached, true, &mpro_kernels_xrgb8888_scalar[0]),
+	MPRO_KERNEL_SET(xrgb8888_neon, cached, true, &mpro_kernels_xrgb8888_scalar[1]),
+};
+
+static const struct mpro_line_ops mpro_line_ops_neon = {
+	.name = "neon",
+	.xrgb8888 = mpro_kernels_xrgb8888_neon,
+};
+#endif
+
+/*
+ * Kernels for a framebuffer, resolved once per plane state in
+ * atomic_check. Imported buffers may be write-combined and are read
+ * through the uncached kernels.
+ */
+const struct mpro_kernels *mpro_kernels_lookup(struct mpro_device *mpro, const struct drm_framebuffer *fb) {
+
+	bool cached = !fb -> obj[0] -> import_attach;
+
+	switch ( fb -> format -> format ) {
+	case DRM_FORMAT_RGB565:
+		return &mpro_kernels_rgb565[cached];
+	case DRM_FORMAT_BGR565:
+		return &mpro_kernels_bgr565[cached];
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888: /* primary plane is opaque, alpha is ignored */
+		return &mpro -> line_ops -> xrgb8888[cached];
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_ABGR8888:
+		return &mpro_kernels_xbgr8888[cached];
+	case DRM_FORMAT_RGB888:
+		return &mpro_kernels_rgb888[cached];
+	case DRM_FORMAT_BGR888:
+		return &mpro_kernels_bgr888[cached];
+	default:
+		return NULL;
+	}
+}
+
+static int mpro_conv_state_alloc(struct mpro_device *mpro, struct drm_format_conv_state *state) {
+
+	unsigned int width = max(mpro -> info.width, mpro -> info.height);
+	size_t size = round_up(width * 4, ARCH_KMALLOC_MINALIGN) + MPRO_TILE * width * 2;
+	void *mem;
+
+	size = ALIGN(size, L1_CACHE_BYTES);
+	mem = drmm_kmalloc(&mpro -> dev, size + L1_CACHE_BYTES, GFP_KERNEL);
+	if ( !mem )
+		return -ENOMEM;
+
+	*state = (struct drm_format_conv_state)
+		__DRM_FORMAT_CONV_STATE_INIT(PTR_ALIGN(mem, L1_CACHE_BYTES), size, true);
+
+	return 0;
+}
+
+static void mpro_conv_release(struct drm_device *dev, void *res) {
+
+	struct mpro_device *mpro = to_mpro(dev);
+
+	destroy_workqueue(mpro -> conv_wq);
+	mpro -> conv_wq = NULL;
+}
+
+static void mpro_band_work(struct work_struct *work);
+
+/*
+ * Line buffers shared by all conversions of the device, large enough
+ * for one source line and MPRO_TILE converted lines along the longer
+ * panel side, which is what a rotated conversion needs. Being
+ * preallocated, reserving from them never allocates on the frame path.
+ * On multi-core machines every band worker gets one of its own.
+ */
+int mpro_conv_init(struct mpro_device *mpro) {
+
+	unsigned int i, nbands = min_t(unsigned int, num_online_cpus(), MPRO_BANDS);
+	int ret;
+
+	ret = mpro_conv_state_alloc(mpro, &mpro -> conv_state);
+	if ( ret || nbands < 2 )
+		return ret;
+
+	for ( i = 1; i < nbands; i++ ) {
+
+		struct mpro_band *band = &mpro -> bands[i];
+
+		ret = mpro_conv_state_alloc(mpro, &band -> state);
+		if ( ret )
+			return ret;
+
+		band -> mpro = mpro;
+		INIT_WORK(&band -> work, mpro_band_work);
 	}
+
+	mpro -> conv_wq = alloc_workqueue("mpro-conv", WQ_UNBOUND | WQ_HIGHPRI, nbands - 1);
+	if ( !mpro -> conv_wq )
+		return 0; /* single threaded conversion still works */
+
+	mpro -> nbands = nbands;
+	return drmm_add_action_or_reset(&mpro -> dev, mpro_conv_release, NULL);
 }
 
-# else
+/* Pick the fastest line converters this cpu can run */
+void mpro_select_line_ops(struct mpro_device *mpro) {
 
-void drm_fb_xrgb8888_to_rgb565(struct iosys_map *dst, const unsigned int *dst_pitch,
-                               const struct iosys_map *src, const struct drm_framebuffer *fb,
-                               const struct drm_rect *clip, bool swab) {
+	mpro -> line_ops = &mpro_line_ops_scalar;
 
-	struct drm_format_conv_state fmtcnv_state = DRM_FORMAT_CONV_STATE_INIT;
-	drm_fb_xrgb8888_to_rgb565(dst, dst_pitch, src, fb, clip, &fmtcnv_state, swab);
+#if defined(MPRO_SIMD_X86)
+	if ( boot_cpu_has(X86_FEATURE_AVX2) && boot_cpu_has(X86_FEATURE_OSXSAVE))
+		mpro -> line_ops = &mpro_line_ops_avx2;
+	else if ( boot_cpu_has(X86_FEATURE_XMM2))
+		mpro -> line_ops = &mpro_line_ops_sse2;
+#elif defined(MPRO_SIMD_NEON)
+	if ( cpu_have_named_feature(ASIMD) && !IS_ENABLED(CONFIG_CPU_BIG_ENDIAN))
+		mpro -> line_ops = &mpro_line_ops_neon;
+#endif
+
+	drm_info(&mpro -> dev, "using %s pixel conversion", mpro -> line_ops -> name);
 }
+
+static bool mpro_simd_begin(const struct mpro_kernels *kernels) {
+
+	if ( !kernels -> simd || !may_use_simd())
+		return false;
+
+#if defined(MPRO_SIMD_X86)
+	kernel_fpu_begin();
+#elif defined(MPRO_SIMD_NEON)
+	kernel_neon_begin();
 #endif
+	return true;
+}
 
-void drm_fb_xrgb8888_to_rgb565_flipped(struct iosys_map *dst, const unsigned int *dst_pitch,
+static void mpro_simd_end(void) {
+
+#if defined(MPRO_SIMD_X86)
+	kernel_fpu_end();
+#elif defined(MPRO_SIMD_NEON)
+	kernel_neon_end();
+#endif
+}
+
+/*
+ * Panel offset in pixels of source pixel (u, v) of a w x h source rect.
+ * Reflections apply first, then the rotation, the same way as
+ * drm_rect_rotate().
+ */
+static int mpro_xfrm_offset(unsigned int rotation, int w, int h, int pitch, int u, int v) {
+
+	int x, y;
+
+	if ( rotation & DRM_MODE_REFLECT_X )
+		u = w - 1 - u;
+	if ( rotation & DRM_MODE_REFLECT_Y )
+		v = h - 1 - v;
+
+	switch ( rotation & DRM_MODE_ROTATE_MASK ) {
+	case DRM_MODE_ROTATE_90:
+		x = v;
+		y = w - 1 - u;
+		break;
+	case DRM_MODE_ROTATE_180:
+		x = w - 1 - u;
+		y = h - 1 - v;
+		break;
+	case DRM_MODE_ROTATE_270:
+		x = h - 1 - v;
+		y = u;
+		break;
+	default:
+		x = u;
+		y = v;
+	}
+
+	return y * pitch + x;
+}
+
+static void mpro_conv_job_init(struct mpro_conv_job *job, const struct mpro_kernels *kernels,
+			       struct iosys_map *dst, unsigned int dst_pitch,
 			       const struct iosys_map *src, const struct drm_framebuffer *fb,
-			       const struct drm_rect *clip, bool swab) {
+			       const struct drm_rect *clip, unsigned int rotation) {
+
+	unsigned int cpp = fb -> format -> cpp[0];
+	int w = drm_rect_width(clip), h = drm_rect_height(clip);
+	int pitch = dst_pitch / sizeof(u16);
+	int base = mpro_xfrm_offset(rotation, w, h, pitch, 0, 0);
+
+	job -> du = mpro_xfrm_offset(rotation, w, h, pitch, 1, 0) - base;
+	job -> dv = mpro_xfrm_offset(rotation, w, h, pitch, 0, 1) - base;
+	job -> mode = job -> du == 1 ? MPRO_XFRM_ROWS : job -> du == -1 ? MPRO_XFRM_MIRRORED : MPRO_XFRM_COLUMNS;
+
+	/* mirrored lines are written by the flipped converter from their left end */
+	if ( job -> mode == MPRO_XFRM_MIRRORED )
+		base -= w - 1;
+
+	job -> dbuf = (u16 *)dst -> vaddr + base;
+	job -> vaddr = src[0].vaddr + clip -> y1 * fb -> pitches[0] + clip -> x1 * cpp;
+	job -> src_pitch = fb -> pitches[0];
+	job -> width = w;
+	job -> sbuf_len = w * cpp;
+	job -> stmp_len = round_up(job -> sbuf_len, ARCH_KMALLOC_MINALIGN);
+	job -> kernels = kernels;
+	job -> clip = *clip;
+}
+
+static void mpro_convert_band(struct mpro_device *mpro, const struct mpro_conv_job *job,
+			      unsigned int first, unsigned int last, struct drm_format_conv_state *state) {
+
+	const struct mpro_kernels *kernels = job -> kernels;
+	struct drm_rect clip = job -> clip;
+	size_t len = job -> stmp_len;
+	unsigned int y, end;
+	bool simd;
+	void *tmp;
+
+	if ( job -> mode == MPRO_XFRM_COLUMNS )
+		len += MPRO_TILE * job -> width * sizeof(u16);
+
+	tmp = drm_format_conv_state_reserve(state, len, GFP_KERNEL);
+	if ( !tmp )
+		return;
+
+	// fpu sections are kept short, they hold off preemption
+	for ( y = first; y < last; y = end ) {
+
+		end = min(y + MPRO_SIMD_LINES, last);
+
+		simd = mpro_simd_begin(job -> kernels);
+		kernels = job -> kernels -> simd && !simd ? job -> kernels -> fallback : job -> kernels;
+
+		kernels -> fn[job -> mode](job, y, end, tmp);
+
+		if ( simd )
+			mpro_simd_end();
+	}
+
+	clip.y1 = job -> clip.y1 + first;
+	clip.y2 = job -> clip.y1 + last;
+	trace_mpro_convert_band(mpro_minor(mpro), &clip, drm_rect_width(&clip) * drm_rect_height(&clip) * MPRO_BPP / 8);
+}
+
+static void mpro_band_work(struct work_struct *work) {
+
+	struct mpro_band *band = container_of(work, struct mpro_band, work);
+
+	mpro_convert_band(band -> mpro, band -> job, band -> first, band -> last, &band -> state);
+}
+
+/*
+ * Convert clip of the framebuffer into dst, which is the top left of
+ * where the clip lands on the panel after rotation. Large rects are
+ * split into bands of source lines converted in parallel.
+ */
+void mpro_fb_convert(struct mpro_device *mpro, const struct mpro_kernels *kernels,
+		     struct iosys_map *dst, const unsigned int *dst_pitch,
+		     const struct iosys_map *src, const struct drm_framebuffer *fb,
+		     const struct drm_rect *clip, unsigned int rotation) {
+
+	struct mpro_conv_job job;
+	unsigned int lines = drm_rect_height(clip);
+	unsigned int i, nbands, step;
+
+	mpro_conv_job_init(&job, kernels, dst, *dst_pitch, src, fb, clip, rotation);
+
+	nbands = min_t(unsigned int, mpro -> nbands, lines / MPRO_BAND_LINES);
+
+	/* small rects are not worth waking up other cores for */
+	if ( !mpro -> conv_wq || nbands < 2 || (u64)drm_rect_width(clip) * lines < MPRO_BAND_PIXELS ) {
+		mpro_convert_band(mpro, &job, 0, lines, &mpro -> conv_state);
+		return;
+	}
+
+	step = DIV_ROUND_UP(lines, nbands);
+
+	/* bands 1..n go to the workqueue, first one is converted here */
+	for ( i = 1; i < nbands; i++ ) {
+
+		struct mpro_band *band = &mpro -> bands[i];
+
+		if ( i * step >= lines ) {
+			nbands = i;
+			break;
+		}
+
+		band -> job = &job;
+		band -> first = i * step;
+		band -> last = min(band -> first + step, lines);
+
+		queue_work(mpro -> conv_wq, &band -> work);
+	}
+
+	mpro_convert_band(mpro, &job, 0, step, &mpro -> conv_state);
+
+	for ( i = 1; i < nbands; i++ )
+		flush_work(&mpro -> bands[i].work);
+}
+
+/*
+ * Plane rotation with config.flipx on top. The x flip mirrors the
+ * panel, after rotation, which is a reflection of the other source
+ * axis when rotated by 90 or 270 degrees.
+ */
+unsigned int mpro_rotation(struct mpro_device *mpro, const struct drm_plane_state *plane_state) {
+
+	unsigned int rotation = plane_state -> rotation;
+
+	if ( mpro -> config.flipx )
+		rotation ^= rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270) ?
+			DRM_MODE_REFLECT_Y : DRM_MODE_REFLECT_X;
+
+	return rotation;
+}
+
+/* Map a rect of the framebuffer to panel coordinates */
+void mpro_rect_to_panel(const struct drm_plane_state *plane_state, unsigned int rotation, struct drm_rect *r) {
+
+	struct drm_rect src = drm_plane_state_src(plane_state);
+
+	drm_rect_fp_to_int(&src, &src);
+	drm_rect_translate(r, -src.x1, -src.y1);
+	drm_rect_rotate(r, drm_rect_width(&src), drm_rect_height(&src), rotation);
+	drm_rect_translate(r, plane_state -> dst.x1, plane_state -> dst.y1);
+}
+
+/* Map a rect of the panel back to framebuffer coordinates */
+void mpro_rect_to_fb(const struct drm_plane_state *plane_state, unsigned int rotation, struct drm_rect *r) {
 
-	static const u8 dst_pixsize[DRM_FORMAT_MAX_PLANES] = { 2, };
-	struct drm_format_conv_state fmtcnv_state = DRM_FORMAT_CONV_STATE_INIT;
-	void (*xfrm_line)(void *dbuf, const void *sbuf, unsigned int npixels);
+	struct drm_rect src = drm_plane_state_src(plane_state);
 
-	xfrm_line = drm_fb_xrgb8888_to_rgb565_line_flipped;
-	drm_fb_xfrm(dst, dst_pitch, dst_pixsize, src, fb, clip, false, &fmtcnv_state, xfrm_line);
+	drm_rect_fp_to_int(&src, &src);
+	drm_rect_translate(r, -plane_state -> dst.x1, -plane_state -> dst.y1);
+	drm_rect_rotate_inv(r, drm_rect_width(&src), drm_rect_height(&src), rotation);
+	drm_rect_translate(r, src.x1, src.y1);
 }
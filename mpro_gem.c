@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: MIT */
+#include <linux/dma-buf.h>
+#include <linux/slab.h>
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_framebuffer.h>
+#include <drm/drm_gem_atomic_helper.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_prime.h>
+#include <drm/drm_print.h>
+#include "mpro.h"
+
+/*
+ * Buffers shared by a render gpu are attached to the usb host
+ * controller, which is the device that reads them. Framebuffers on top
+ * of imported buffers are vmapped once when they are created and
+ * converted straight from that mapping. Reads are still bracketed by
+ * dma_buf_begin_cpu_access() and dma_buf_end_cpu_access() through
+ * drm_gem_fb_begin_cpu_access(), so the exporter makes its cpu view
+ * coherent.
+ */
+
+struct drm_gem_object *mpro_gem_prime_import(struct drm_device *dev, struct dma_buf *dma_buf) {
+
+	struct mpro_device *mpro = to_mpro(dev);
+
+	if ( !mpro -> dmadev )
+		return ERR_PTR(-ENODEV);
+
+	return drm_gem_prime_import_dev(dev, dma_buf, mpro -> dmadev);
+}
+
+static void mpro_fb_destroy(struct drm_framebuffer *fb) {
+
+	struct mpro_framebuffer *mfb = to_mpro_framebuffer(fb);
+
+	if ( mfb -> mapped )
+		drm_gem_fb_vunmap(fb, mfb -> map);
+
+	drm_gem_fb_destroy(fb);
+}
+
+static const struct drm_framebuffer_funcs mpro_fb_funcs = {
+	.destroy = mpro_fb_destroy,
+	.create_handle = drm_gem_fb_create_handle,
+	.dirty = drm_atomic_helper_dirtyfb,
+};
+
+struct drm_framebuffer *mpro_fb_create(struct drm_device *dev, struct drm_file *file,
+				       const struct drm_mode_fb_cmd2 *mode_cmd) {
+
+	struct mpro_framebuffer *mfb;
+	int ret;
+
+	mfb = kzalloc(sizeof(*mfb), GFP_KERNEL);
+	if ( !mfb )
+		return ERR_PTR(-ENOMEM);
+
+	ret = drm_gem_fb_init_with_funcs(dev, &mfb -> base, file, mode_cmd, &mpro_fb_funcs);
+	if ( ret ) {
+		kfree(mfb);
+		return ERR_PTR(ret);
+	}
+
+	// imported buffers stay mapped for the lifetime of the framebuffer
+	if ( mfb -> base.obj[0] -> import_attach ) {
+		ret = drm_gem_fb_vmap(&mfb -> base, mfb -> map, mfb -> data);
+		if ( ret )
+			drm_dbg(dev, "no persistent mapping for imported buffer: %d\n", ret);
+		else
+			mfb -> mapped = true;
+	}
+
+	return &mfb -> base;
+}
+
+bool mpro_fb_mapped(const struct drm_framebuffer *fb) {
+
+	return fb && fb -> funcs == &mpro_fb_funcs && to_mpro_framebuffer(fb) -> mapped;
+}
+
+/*
+ * Shadow plane access hooks. Persistently mapped framebuffers hand out
+ * their mapping, everything else is vmapped per commit by the helpers.
+ */
+int mpro_fb_begin_access(struct drm_plane *plane, struct drm_plane_state *plane_state) {
+
+	struct drm_shadow_plane_state *shadow_plane_state = to_drm_shadow_plane_state(plane_state);
+	struct mpro_framebuffer *mfb;
+
+	if ( !mpro_fb_mapped(plane_state -> fb))
+		return drm_gem_begin_shadow_fb_access(plane, plane_state);
+
+	mfb = to_mpro_framebuffer(plane_state -> fb);
+	memcpy(shadow_plane_state -> map, mfb -> map, sizeof(mfb -> map));
+	memcpy(shadow_plane_state -> data, mfb -> data, sizeof(mfb -> data));
+
+	return 0;
+}
+
+void mpro_fb_end_access(struct drm_plane *plane, struct drm_plane_state *plane_state) {
+
+	if ( !mpro_fb_mapped(plane_state -> fb))
+		drm_gem_end_shadow_fb_access(plane, plane_state);
+}
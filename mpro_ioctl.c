@@ -0,0 +1,269 @@
+/* SPDX-License-Identifier: MIT */
+#include <linux/dma-fence.h>
+#include <linux/file.h>
+#include <linux/sync_file.h>
+#include <linux/uaccess.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_file.h>
+#include <drm/drm_gem.h>
+#include <drm/drm_managed.h>
+#include <drm/drm_print.h>
+#include <drm/drm_rect.h>
+#include "mpro.h"
+#include "mpro_drm.h"
+
+/*
+ * Direct flush: rects of a buffer that already is in device layout are
+ * copied into the back buffer and go out as draw commands, skipping
+ * state duplication, shadow plane mapping and conversion of a commit.
+ * The last flushed buffer stays vmapped until another one is flushed
+ * or the device goes away.
+ */
+
+static void mpro_flush_unmap(struct mpro_device *mpro) {
+
+	if ( !mpro -> flush_obj )
+		return;
+
+	drm_gem_vunmap_unlocked(mpro -> flush_obj, &mpro -> flush_map);
+	drm_gem_object_put(mpro -> flush_obj);
+	mpro -> flush_obj = NULL;
+}
+
+static void mpro_flush_release(struct drm_device *dev, void *res) {
+
+	mpro_flush_unmap(to_mpro(dev));
+}
+
+int mpro_flush_init(struct mpro_device *mpro) {
+
+	return drmm_add_action_or_reset(&mpro -> dev, mpro_flush_release, NULL);
+}
+
+/* Mapping of the buffer behind handle; called with config_lock held */
+static const void *mpro_flush_map(struct mpro_device *mpro, struct drm_file *file, u32 handle, unsigned int pitch) {
+
+	struct drm_gem_object *obj;
+	struct iosys_map map;
+	int ret;
+
+	obj = drm_gem_object_lookup(file, handle);
+	if ( !obj )
+		return ERR_PTR(-ENOENT);
+
+	// imported buffers need cpu access syncing, that is what commits are for
+	if ( obj -> import_attach || (u64)pitch * mpro -> info.height > obj -> size ) {
+		ret = -EINVAL;
+		goto err_put;
+	}
+
+	if ( obj == mpro -> flush_obj ) {
+		drm_gem_object_put(obj);
+		return mpro -> flush_map.vaddr;
+	}
+
+	ret = drm_gem_vmap_unlocked(obj, &map);
+	if ( ret )
+		goto err_put;
+
+	if ( map.is_iomem ) {
+		drm_gem_vunmap_unlocked(obj, &map);
+		ret = -EINVAL;
+		goto err_put;
+	}
+
+	// lookup reference is kept with the mapping
+	mpro_flush_unmap(mpro);
+	mpro -> flush_obj = obj;
+	mpro -> flush_map = map;
+
+	return map.vaddr;
+
+err_put:
+	drm_gem_object_put(obj);
+	return ERR_PTR(ret);
+}
+
+static void mpro_flush_copy(struct mpro_device *mpro, struct mpro_frame *frame, const void *vaddr,
+			    unsigned int pitch, const struct drm_rect *rect) {
+
+	unsigned int linelen = drm_rect_width(rect) * MPRO_BPP / 8;
+	const unsigned char *src = vaddr + rect -> y1 * pitch + rect -> x1 * MPRO_BPP / 8;
+	unsigned char *dst = frame -> data + rect -> y1 * mpro -> pitch + rect -> x1 * MPRO_BPP / 8;
+	int y;
+
+	for ( y = rect -> y1; y < rect -> y2; y++ ) {
+		memcpy(dst, src, linelen);
+		dst += mpro -> pitch;
+		src += pitch;
+	}
+}
+
+/*
+ * Whether rects, added to what was counted before, still go out as
+ * partial updates; mpro_blit() falls back to a full frame update when
+ * one covers the panel, there are too many or they overflow the pack
+ * buffer.
+ */
+static bool mpro_flush_partial(struct mpro_device *mpro, const struct drm_rect *rects, unsigned int n,
+			       unsigned int *ncmds, u64 *len) {
+
+	unsigned int i;
+
+	for ( i = 0; i < n; i++ ) {
+
+		if ( drm_rect_equals(&rects[i], &mpro -> info.rect))
+			return false;
+
+		*len += (u64)drm_rect_width(&rects[i]) * drm_rect_height(&rects[i]) * MPRO_BPP / 8;
+	}
+
+	*ncmds += n;
+
+	return mpro -> config.partial >= 0 && *ncmds <= MPRO_MAX_CMDS && *len <= mpro -> block_size;
+}
+
+int mpro_flush_ioctl(struct drm_device *dev, void *data, struct drm_file *file) {
+
+	struct mpro_device *mpro = to_mpro(dev);
+	struct drm_mpro_flush *args = data;
+	struct drm_mpro_rect urects[MPRO_MAX_CMDS];
+	struct drm_rect rects[MPRO_MAX_CMDS], area = { };
+	unsigned int align = max_t(unsigned int, mpro -> config.align, 1);
+	struct sync_file *sync_file = NULL;
+	struct dma_fence *fence;
+	struct mpro_frame *frame;
+	const void *vaddr;
+	unsigned int i, ncmds = 0;
+	u64 len = 0;
+	int fd = -1;
+	int ret, idx;
+
+	if (( args -> flags & ~MPRO_FLUSH_FLAGS ) || args -> pad )
+		return -EINVAL;
+
+	if ( !args -> num_rects || args -> num_rects > MPRO_MAX_CMDS )
+		return -EINVAL;
+
+	if ( args -> pitch < mpro -> info.width * MPRO_BPP / 8 )
+		return -EINVAL;
+
+	if ( copy_from_user(urects, u64_to_user_ptr(args -> rects), args -> num_rects * sizeof(urects[0])))
+		return -EFAULT;
+
+	for ( i = 0; i < args -> num_rects; i++ ) {
+
+		struct drm_mpro_rect *r = &urects[i];
+
+		if ( !r -> width || !r -> height ||
+		     (u64)r -> x + r -> width > mpro -> info.width ||
+		     (u64)r -> y + r -> height > mpro -> info.height )
+			return -EINVAL;
+
+		rects[i] = DRM_RECT_INIT(r -> x, r -> y, r -> width, r -> height);
+		rects[i].x1 = rounddown(rects[i].x1, align);
+		rects[i].x2 = min_t(int, roundup(rects[i].x2, align), mpro -> info.width);
+	}
+
+	if ( args -> flags & MPRO_FLUSH_OUT_FENCE ) {
+		fd = get_unused_fd_flags(O_CLOEXEC);
+		if ( fd < 0 )
+			return fd;
+	}
+
+	if ( !drm_dev_enter(dev, &idx)) {
+		ret = -ENODEV;
+		goto out_put_fd;
+	}
+
+	// same lock as the plane updates, this is what orders flushes and commits
+	mutex_lock(&mpro -> config_lock);
+
+	vaddr = mpro_flush_map(mpro, file, args -> handle, args -> pitch);
+	if ( IS_ERR(vaddr)) {
+		ret = PTR_ERR(vaddr);
+		goto out_mutex_unlock;
+	}
+
+	/*
+	 * Frames lack the framebuffer last sent directly by a commit, a full
+	 * frame update from them would bring back old pixels. Nothing is sent
+	 * when the flush would turn into one; a queued direct frame is left
+	 * alone, taking it back would drop its mapping.
+	 */
+	if ( mpro -> resync && mpro_frame_pending_direct(mpro)) {
+		ret = -EBUSY;
+		goto out_mutex_unlock;
+	}
+
+	frame = mpro_frame_begin(mpro);
+	if ( IS_ERR(frame)) {
+		ret = PTR_ERR(frame);
+		goto out_mutex_unlock;
+	}
+
+	if ( mpro -> resync && !( mpro_flush_partial(mpro, frame -> carry, frame -> ncarry, &ncmds, &len) &&
+				   mpro_flush_partial(mpro, rects, args -> num_rects, &ncmds, &len))) {
+
+		// taken back rects still go out, unless they need a full frame too
+		ncmds = len = 0;
+		if ( mpro_flush_partial(mpro, frame -> carry, frame -> ncarry, &ncmds, &len)) {
+			for ( i = 0; i < frame -> ncarry; i++ )
+				mpro_blit(mpro, frame, &frame -> carry[i]);
+		} else
+			mpro -> redraw = true;
+
+		mpro_frame_flush(mpro, frame, &area);
+		ret = -EBUSY;
+		goto out_mutex_unlock;
+	}
+
+	// queued frame was taken back, its rects go out with this flush
+	for ( i = 0; i < frame -> ncarry; i++ )
+		mpro_blit(mpro, frame, &frame -> carry[i]);
+
+	for ( i = 0; i < args -> num_rects; i++ ) {
+		mpro_flush_copy(mpro, frame, vaddr, args -> pitch, &rects[i]);
+		mpro_layers_blend(mpro, frame -> data + drm_fb_clip_offset(mpro -> pitch, mpro -> format, &rects[i]),
+				  mpro -> pitch, &rects[i]);
+		mpro_rect_union(&area, &rects[i]);
+
+		if ( mpro -> config.partial >= 0 )
+			mpro_blit(mpro, frame, &rects[i]);
+	}
+
+	// no partial updates in this firmware
+	if ( mpro -> config.partial < 0 )
+		mpro_blit(mpro, frame, &mpro -> info.rect);
+
+	if ( args -> flags & MPRO_FLUSH_OUT_FENCE ) {
+		fence = mpro_frame_fence(mpro, frame);
+		if ( fence ) {
+			sync_file = sync_file_create(fence);
+			dma_fence_put(fence);
+		}
+	}
+
+	ret = mpro_frame_flush(mpro, frame, &area);
+	if ( !ret && ( args -> flags & MPRO_FLUSH_OUT_FENCE ) && !sync_file )
+		ret = -ENOMEM;
+
+out_mutex_unlock:
+	mutex_unlock(&mpro -> config_lock);
+	drm_dev_exit(idx);
+
+	if ( sync_file ) {
+		if ( !ret ) {
+			fd_install(fd, sync_file -> file);
+			args -> fence_fd = fd;
+			return 0;
+		}
+		fput(sync_file -> file);
+	}
+
+out_put_fd:
+	if ( fd >= 0 )
+		put_unused_fd(fd);
+
+	return ret;
+}
@@ -0,0 +1,427 @@
+/* SPDX-License-Identifier: MIT */
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <drm/drm_atomic.h>
+#include <drm/drm_atomic_helper.h>
+#include <drm/drm_blend.h>
+#include <drm/drm_damage_helper.h>
+#include <drm/drm_drv.h>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_gem_atomic_helper.h>
+#include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_managed.h>
+#include <drm/drm_modeset_helper_vtables.h>
+#include <drm/drm_print.h>
+#include "mpro.h"
+
+/*
+ * Overlay and cursor planes. The panel shows one image, so these are
+ * composed by the driver: each layer keeps a premultiplied copy of its
+ * visible pixels in layer -> image, updated only where its framebuffer
+ * was damaged, and the primary plane update blends the layers in zpos
+ * order over every rect it converts.
+ *
+ * A layer update pulls the primary plane into the commit marked
+ * layers_only: its framebuffer damage is skipped, and only the rects
+ * where layers changed, moved from or moved to are converted, blended
+ * and sent, as partial updates.
+ *
+ * Layer planes are created before the primary one, so that within a
+ * commit their updates run first and the primary update sees them.
+ */
+
+static const uint32_t mpro_overlay_formats[] = {
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_XRGB8888,
+};
+
+static const uint32_t mpro_cursor_formats[] = {
+	DRM_FORMAT_ARGB8888,
+};
+
+static inline struct mpro_layer *to_mpro_layer(struct drm_plane *plane) {
+	return container_of(plane, struct mpro_layer, plane);
+}
+
+/* Layer rect on the panel, flipx mirrors it like the primary plane */
+static bool mpro_layer_rect(struct mpro_device *mpro, const struct drm_rect *rect, struct drm_rect *r) {
+
+	*r = *rect;
+
+	if ( mpro -> config.flipx ) {
+		r -> x1 = mpro -> info.width - rect -> x2;
+		r -> x2 = mpro -> info.width - rect -> x1;
+	}
+
+	return drm_rect_visible(r);
+}
+
+bool mpro_layers_visible(struct mpro_device *mpro) {
+
+	int i;
+
+	for ( i = 0; i < MPRO_LAYERS; i++ )
+		if ( mpro -> layers[i].visible )
+			return true;
+
+	return false;
+}
+
+/* Frames no longer show any layer, like after the screen was cleared */
+void mpro_layers_reset(struct mpro_device *mpro) {
+
+	int i;
+
+	for ( i = 0; i < MPRO_LAYERS; i++ )
+		mpro -> layers[i].shown = DRM_RECT_INIT(0, 0, 0, 0);
+}
+
+/*
+ * Add what changed in the layers since they were drawn last to d: the
+ * rect a layer moved away from and the one it moved to, or the part of
+ * its image that was updated in place.
+ */
+void mpro_layers_damage(struct mpro_device *mpro, struct mpro_damage *d) {
+
+	struct drm_rect r;
+	int i;
+
+	for ( i = 0; i < MPRO_LAYERS; i++ ) {
+
+		struct mpro_layer *layer = &mpro -> layers[i];
+
+		if ( !layer -> visible || !mpro_layer_rect(mpro, &layer -> rect, &r))
+			r = DRM_RECT_INIT(0, 0, 0, 0);
+
+		if ( !drm_rect_equals(&r, &layer -> shown)) {
+
+			if ( drm_rect_visible(&layer -> shown))
+				mpro_damage_add(mpro, d, &layer -> shown);
+
+			if ( drm_rect_visible(&r))
+				mpro_damage_add(mpro, d, &r);
+
+			layer -> shown = r;
+
+		} else if ( layer -> visible && mpro_layer_rect(mpro, &layer -> damage, &r))
+			mpro_damage_add(mpro, d, &r);
+
+		layer -> damage = DRM_RECT_INIT(0, 0, 0, 0);
+	}
+}
+
+static inline u16 mpro_layer_pixel(u32 argb, u16 pix) {
+
+	unsigned int ia = 255 - (argb >> 24);
+	unsigned int r, g, b;
+
+	if ( !ia )
+		return ((argb >> 8) & 0xF800) | ((argb >> 5) & 0x07E0) | ((argb >> 3) & 0x001F);
+
+	r = (pix >> 11) << 3 | (pix >> 13);
+	g = ((pix >> 5) & 0x3F) << 2 | ((pix >> 9) & 0x03);
+	b = (pix & 0x1F) << 3 | ((pix >> 2) & 0x07);
+
+	r = min(((argb >> 16) & 0xFF) + DIV_ROUND_CLOSEST(r * ia, 255), 255U);
+	g = min(((argb >> 8) & 0xFF) + DIV_ROUND_CLOSEST(g * ia, 255), 255U);
+	b = min((argb & 0xFF) + DIV_ROUND_CLOSEST(b * ia, 255), 255U);
+
+	return (r & 0xF8) << 8 | (g & 0xFC) << 3 | b >> 3;
+}
+
+static void mpro_layer_blend(struct mpro_device *mpro, struct mpro_layer *layer,
+			     void *dst, unsigned int pitch, const struct drm_rect *rect) {
+
+	struct drm_rect pos, r;
+	int x, y;
+
+	if ( !layer -> visible || !mpro_layer_rect(mpro, &layer -> rect, &pos))
+		return;
+
+	r = pos;
+	if ( !drm_rect_intersect(&r, rect))
+		return;
+
+	for ( y = r.y1; y < r.y2; y++ ) {
+
+		__le16 *line = dst + (y - rect -> y1) * pitch;
+		const u32 *src = layer -> image + (y - pos.y1) * layer -> pitch;
+
+		for ( x = r.x1; x < r.x2; x++ ) {
+
+			u32 argb = src[mpro -> config.flipx ? pos.x2 - 1 - x : x - pos.x1];
+
+			// premultiplied: zero alpha with color still adds light
+			if ( argb )
+				line[x - rect -> x1] = cpu_to_le16(mpro_layer_pixel(argb, le16_to_cpu(line[x - rect -> x1])));
+		}
+	}
+}
+
+static int mpro_layer_cmp(const void *a, const void *b) {
+
+	const struct mpro_layer *la = *(const struct mpro_layer **)a;
+	const struct mpro_layer *lb = *(const struct mpro_layer **)b;
+
+	if ( la -> zpos != lb -> zpos )
+		return la -> zpos < lb -> zpos ? -1 : 1;
+
+	return la < lb ? -1 : la > lb;
+}
+
+/*
+ * Blend the layers over rect of the panel, bottom one first. dst holds
+ * the converted pixels of rect, starting from its top left pixel, pitch
+ * bytes apart.
+ */
+void mpro_layers_blend(struct mpro_device *mpro, void *dst, unsigned int pitch, const struct drm_rect *rect) {
+
+	struct mpro_layer *order[MPRO_LAYERS];
+	int i, n = 0;
+
+	for ( i = 0; i < MPRO_LAYERS; i++ )
+		if ( mpro -> layers[i].visible )
+			order[n++] = &mpro -> layers[i];
+
+	if ( !n )
+		return;
+
+	sort(order, n, sizeof(order[0]), mpro_layer_cmp, NULL);
+
+	for ( i = 0; i < n; i++ )
+		mpro_layer_blend(mpro, order[i], dst, pitch, rect);
+}
+
+static int mpro_layer_helper_atomic_check(struct drm_plane *plane, struct drm_atomic_state *state) {
+
+	struct mpro_device *mpro = to_mpro(plane -> dev);
+	struct drm_plane_state *plane_state = drm_atomic_get_new_plane_state(state, plane);
+	struct drm_plane_state *primary_state;
+	struct drm_crtc_state *crtc_state = NULL;
+	int ret;
+
+	if ( plane_state -> crtc )
+		crtc_state = drm_atomic_get_new_crtc_state(state, plane_state -> crtc);
+
+	ret = drm_atomic_helper_check_plane_state(plane_state, crtc_state,
+						  DRM_PLANE_NO_SCALING, DRM_PLANE_NO_SCALING,
+						  true, true);
+	if ( ret )
+		return ret;
+
+	if ( plane -> type == DRM_PLANE_TYPE_CURSOR && plane_state -> fb &&
+	     ( plane_state -> fb -> width > MPRO_CURSOR_SIZE || plane_state -> fb -> height > MPRO_CURSOR_SIZE ))
+		return -EINVAL;
+
+	// primary plane is already in the commit and redraws its damage anyway
+	if ( drm_atomic_get_new_plane_state(state, &mpro -> primary_plane))
+		return 0;
+
+	primary_state = drm_atomic_get_plane_state(state, &mpro -> primary_plane);
+	if ( IS_ERR(primary_state))
+		return PTR_ERR(primary_state);
+
+	to_mpro_plane_state(primary_state) -> layers_only = true;
+
+	return 0;
+}
+
+/* Copy clip of the framebuffer, premultiplied and with plane alpha applied, into the layer image */
+static void mpro_layer_copy(struct mpro_layer *layer, struct drm_plane_state *plane_state,
+			    const struct drm_rect *src, const struct drm_rect *clip) {
+
+	struct drm_shadow_plane_state *shadow_plane_state = to_drm_shadow_plane_state(plane_state);
+	struct drm_framebuffer *fb = plane_state -> fb;
+	bool opaque = !fb -> format -> has_alpha || plane_state -> pixel_blend_mode == DRM_MODE_BLEND_PIXEL_NONE;
+	bool coverage = plane_state -> pixel_blend_mode == DRM_MODE_BLEND_COVERAGE;
+	unsigned int alpha = plane_state -> alpha >> 8;
+	int x, y;
+
+	for ( y = clip -> y1; y < clip -> y2; y++ ) {
+
+		const __le32 *line = shadow_plane_state -> data[0].vaddr + y * fb -> pitches[0];
+		u32 *out = layer -> image + (y - src -> y1) * layer -> pitch - src -> x1;
+
+		for ( x = clip -> x1; x < clip -> x2; x++ ) {
+
+			u32 argb = le32_to_cpu(line[x]);
+			unsigned int a = opaque ? 255 : argb >> 24;
+			unsigned int r = (argb >> 16) & 0xFF, g = (argb >> 8) & 0xFF, b = argb & 0xFF;
+
+			if ( coverage && !opaque ) {
+				r = DIV_ROUND_CLOSEST(r * a, 255);
+				g = DIV_ROUND_CLOSEST(g * a, 255);
+				b = DIV_ROUND_CLOSEST(b * a, 255);
+			}
+
+			if ( alpha != 255 ) {
+				a = DIV_ROUND_CLOSEST(a * alpha, 255);
+				r = DIV_ROUND_CLOSEST(r * alpha, 255);
+				g = DIV_ROUND_CLOSEST(g * alpha, 255);
+				b = DIV_ROUND_CLOSEST(b * alpha, 255);
+			}
+
+			out[x] = a << 24 | r << 16 | g << 8 | b;
+		}
+	}
+}
+
+/* Rect of the framebuffer as it lands on the crtc */
+static void mpro_layer_to_crtc(const struct drm_plane_state *plane_state, const struct drm_rect *src,
+			       const struct drm_rect *clip, struct drm_rect *r) {
+
+	*r = *clip;
+	drm_rect_translate(r, plane_state -> dst.x1 - src -> x1, plane_state -> dst.y1 - src -> y1);
+}
+
+static void mpro_layer_helper_atomic_update(struct drm_plane *plane, struct drm_atomic_state *state) {
+
+	struct drm_plane_state *plane_state = drm_atomic_get_new_plane_state(state, plane);
+	struct drm_plane_state *old_plane_state = drm_atomic_get_old_plane_state(state, plane);
+	struct drm_framebuffer *fb = plane_state -> fb;
+	struct mpro_device *mpro = to_mpro(plane -> dev);
+	struct mpro_layer *layer = to_mpro_layer(plane);
+	struct drm_atomic_helper_damage_iter iter;
+	struct drm_rect src, clip, r;
+	bool full;
+	int idx;
+
+	if ( !drm_dev_enter(plane -> dev, &idx))
+		return;
+
+	mutex_lock(&mpro -> config_lock);
+
+	layer -> visible = plane_state -> visible;
+	layer -> rect = plane_state -> dst;
+	layer -> zpos = plane_state -> zpos;
+
+	if ( !plane_state -> visible )
+		goto out_mutex_unlock;
+
+	// anything that changes how every pixel looks takes a full copy
+	full = !old_plane_state -> visible ||
+	       !drm_rect_equals(&plane_state -> src, &old_plane_state -> src) ||
+	       plane_state -> alpha != old_plane_state -> alpha ||
+	       plane_state -> pixel_blend_mode != old_plane_state -> pixel_blend_mode ||
+	       plane_state -> zpos != old_plane_state -> zpos ||
+	       ( fb != old_plane_state -> fb && !drm_plane_get_damage_clips_count(plane_state));
+
+	// plain moves keep the image copied last time
+	if ( !full && !drm_plane_get_damage_clips_count(plane_state))
+		goto out_mutex_unlock;
+
+	if ( drm_gem_fb_begin_cpu_access(fb, DMA_FROM_DEVICE))
+		goto out_mutex_unlock;
+
+	drm_rect_fp_to_int(&src, &plane_state -> src);
+
+	if ( full ) {
+		mpro_layer_copy(layer, plane_state, &src, &src);
+		mpro_rect_union(&layer -> damage, &plane_state -> dst);
+
+	} else {
+
+		drm_atomic_helper_damage_iter_init(&iter, old_plane_state, plane_state);
+		drm_atomic_for_each_plane_damage(&iter, &clip) {
+			mpro_layer_copy(layer, plane_state, &src, &clip);
+			mpro_layer_to_crtc(plane_state, &src, &clip, &r);
+			mpro_rect_union(&layer -> damage, &r);
+		}
+	}
+
+	drm_gem_fb_end_cpu_access(fb, DMA_FROM_DEVICE);
+
+out_mutex_unlock:
+	mutex_unlock(&mpro -> config_lock);
+	drm_dev_exit(idx);
+}
+
+static void mpro_layer_helper_atomic_disable(struct drm_plane *plane, struct drm_atomic_state *state) {
+
+	struct mpro_device *mpro = to_mpro(plane -> dev);
+
+	mutex_lock(&mpro -> config_lock);
+	to_mpro_layer(plane) -> visible = false;
+	mutex_unlock(&mpro -> config_lock);
+}
+
+static const struct drm_plane_helper_funcs mpro_layer_helper_funcs = {
+	.begin_fb_access = mpro_fb_begin_access,
+	.end_fb_access = mpro_fb_end_access,
+	.atomic_check = mpro_layer_helper_atomic_check,
+	.atomic_update = mpro_layer_helper_atomic_update,
+	.atomic_disable = mpro_layer_helper_atomic_disable,
+};
+
+static const struct drm_plane_funcs mpro_layer_funcs = {
+	.update_plane = drm_atomic_helper_update_plane,
+	.disable_plane = drm_atomic_helper_disable_plane,
+	.destroy = drm_plane_cleanup,
+	DRM_GEM_SHADOW_PLANE_FUNCS,
+};
+
+static void mpro_layer_release(struct drm_device *dev, void *res) {
+
+	vfree(res);
+}
+
+static int mpro_init_layer(struct mpro_device *mpro, struct mpro_layer *layer, enum drm_plane_type type,
+			   unsigned int width, unsigned int height, unsigned int zpos) {
+
+	struct drm_device *dev = &mpro -> dev;
+	struct drm_plane *plane = &layer -> plane;
+	bool cursor = type == DRM_PLANE_TYPE_CURSOR;
+	int ret;
+
+	// overlay images are panel sized, too large for kmalloc
+	layer -> pitch = width;
+	layer -> image = vzalloc(array3_size(width, height, sizeof(u32)));
+	if ( !layer -> image )
+		return -ENOMEM;
+
+	ret = drmm_add_action_or_reset(dev, mpro_layer_release, layer -> image);
+	if ( ret )
+		return ret;
+
+	/* one crtc, created in mpro_init_connector(), which also claims the cursor */
+	ret = drm_universal_plane_init(dev, plane, cursor ? 0 : BIT(0), &mpro_layer_funcs,
+				       cursor ? mpro_cursor_formats : mpro_overlay_formats,
+				       cursor ? ARRAY_SIZE(mpro_cursor_formats) : ARRAY_SIZE(mpro_overlay_formats),
+				       mpro_primary_plane_format_modifiers, type, NULL);
+	if ( ret )
+		return ret;
+
+	drm_plane_helper_add(plane, &mpro_layer_helper_funcs);
+	drm_plane_enable_fb_damage_clips(plane);
+
+	// cursor stays on top and is blended as it is
+	if ( cursor )
+		return drm_plane_create_zpos_immutable_property(plane, zpos);
+
+	ret = drm_plane_create_zpos_property(plane, zpos, 1, MPRO_OVERLAYS);
+	if ( ret )
+		return ret;
+
+	ret = drm_plane_create_alpha_property(plane);
+	if ( ret )
+		return ret;
+
+	return drm_plane_create_blend_mode_property(plane, BIT(DRM_MODE_BLEND_PIXEL_NONE) |
+						    BIT(DRM_MODE_BLEND_PREMULTI) |
+						    BIT(DRM_MODE_BLEND_COVERAGE));
+}
+
+int mpro_init_layers(struct mpro_device *mpro) {
+
+	int i, ret;
+
+	for ( i = 0; i < MPRO_OVERLAYS; i++ ) {
+		ret = mpro_init_layer(mpro, &mpro -> layers[i], DRM_PLANE_TYPE_OVERLAY,
+				      mpro -> info.width, mpro -> info.height, i + 1);
+		if ( ret )
+			return ret;
+	}
+
+	return mpro_init_layer(mpro, &mpro -> layers[MPRO_LAYER_CURSOR], DRM_PLANE_TYPE_CURSOR,
+			       MPRO_CURSOR_SIZE, MPRO_CURSOR_SIZE, MPRO_OVERLAYS + 1);
+}
@@ -1,9 +1,11 @@
 /* SPDX-License-Identifier: MIT */
 #include <linux/usb.h>
+#include <asm/unaligned.h>
 #include <drm/drm_modes.h>
 #include <drm/drm_print.h>
 #include <drm/drm_atomic_helper.h>
 #include <drm/drm_gem_framebuffer_helper.h>
+#include <drm/drm_modeset_helper_vtables.h>
 #include <drm/drm_rect.h>
 #include "mpro.h"
 
@@ -53,94 +55,78 @@ static const struct drm_format_info *mpro_get_validated_format(struct drm_device
 	return ERR_PTR(-EINVAL);
 }
 
-static int mpro_get_screen(struct mpro_device *mpro) {
+/*
+ * Shared identification query: command out, status byte in, then len
+ * bytes of reply into mpro -> cmd. Commands are copied to mpro -> cmd as
+ * usb transfer buffers must not live in rodata. A query that fails is
+ * tried once more before giving up on the panel.
+ */
+static int mpro_query(struct mpro_device *mpro, const char *cmd, unsigned int len) {
 
 	struct usb_device *udev = mpro_to_usb_device(mpro);
+	int tries = MPRO_QUERY_TRIES;
 	int ret;
 
-	ret = usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
-				0xb5, 0x40, 0, 0,
-				(void*)cmd_get_screen, 5,
-				MPRO_MAX_DELAY);
-	if ( ret < 5 )
-		return -EIO;
-
-	ret = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
-				0xb6, 0xc0, 0, 0,
-				mpro -> cmd, 1, MPRO_MAX_DELAY);
-	if ( ret < 1 )
-		return -EIO;
-
-	ret = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
-				0xb7, 0xc0, 0, 0,
-				mpro -> cmd, 5, MPRO_MAX_DELAY);
-	if ( ret < 5 )
-		return -EIO;
-
-	mpro -> screen = ((unsigned int*)(mpro -> cmd + 1))[0];
-	return 0;
-}
+	while ( tries-- ) {
 
-static int mpro_get_version(struct mpro_device *mpro) {
+		memcpy(mpro -> cmd, cmd, 5);
 
-	struct usb_device *udev = mpro_to_usb_device(mpro);
-	int ret;
+		ret = usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
+					0xb5, 0x40, 0, 0,
+					mpro -> cmd, 5, MPRO_MAX_DELAY);
+		if ( ret < 5 )
+			continue;
 
-	ret = usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
-				0xb5, 0x40, 0, 0,
-				(void*)cmd_get_version, 5,
-				MPRO_MAX_DELAY);
-	if ( ret < 5 )
-		return -EIO;
-
-	ret = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
-				0xb6, 0xc0, 0, 0,
-				mpro -> cmd, 1, MPRO_MAX_DELAY);
-	if ( ret < 1 )
-		return -EIO;
-
-	ret = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
-				0xb7, 0xc0, 0, 0,
-				mpro -> cmd, 5, MPRO_MAX_DELAY);
-	if ( ret < 5 )
-		return -EIO;
-
-	mpro -> version = ((unsigned int *)(mpro -> cmd + 1))[0];
-	return 0;
+		ret = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
+					0xb6, 0xc0, 0, 0,
+					mpro -> cmd, 1, MPRO_MAX_DELAY);
+		if ( ret < 1 )
+			continue;
+
+		ret = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
+					0xb7, 0xc0, 0, 0,
+					mpro -> cmd, len, MPRO_MAX_DELAY);
+		if ( ret >= 5 )
+			return 0;
+	}
+
+	return ret < 0 ? ret : -EIO;
 }
 
-static int mpro_get_id(struct mpro_device *mpro) {
+/* screen, version and id in one go */
+static int mpro_identify(struct mpro_device *mpro) {
 
-	struct usb_device *udev = mpro_to_usb_device(mpro);
 	int ret;
 
-	ret = usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
-				0xb5, 0x40, 0, 0,
-				(void*)cmd_get_id, 5,
-				MPRO_MAX_DELAY);
-	if ( ret < 5 )
-		return -EIO;
-
-	ret = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
-				0xb6, 0xc0, 0, 0,
-				mpro -> cmd, 1, MPRO_MAX_DELAY);
-	if ( ret < 1 )
-		return -EIO;
-
-	ret = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
-				0xb7, 0xc0, 0, 0,
-				mpro -> cmd, 9, MPRO_MAX_DELAY);
-	if ( ret < 5 )
-		return -EIO;
+	ret = mpro_query(mpro, cmd_get_screen, 5);
+	if ( ret ) {
+		drm_err(&mpro -> dev, "can't get screen info.\n");
+		return ret;
+	}
+	mpro -> screen = get_unaligned_le32(mpro -> cmd + 1);
 
+	ret = mpro_query(mpro, cmd_get_version, 5);
+	if ( ret ) {
+		drm_err(&mpro -> dev, "can't get screen version.\n");
+		return ret;
+	}
+	mpro -> version = get_unaligned_le32(mpro -> cmd + 1);
+
+	ret = mpro_query(mpro, cmd_get_id, 9);
+	if ( ret ) {
+		drm_err(&mpro -> dev, "can't get screen id.\n");
+		return ret;
+	}
 	memcpy(mpro -> id, mpro -> cmd + 1, 8);
+
+	drm_dbg(&mpro -> dev, "screen %08x version %08x id %8phN\n", mpro -> screen, mpro -> version, mpro -> id);
 	return 0;
 }
 
 static void mpro_create_info(struct mpro_device *mpro, unsigned int width, unsigned int height,
 			     unsigned int width_mm, unsigned int height_mm, unsigned int margin) {
 
-	struct drm_rect rect = { .x1 = 0, .y1 = 0, .x2 = width - 1, .y2 = height - 1 };
+	struct drm_rect rect = { .x1 = 0, .y1 = 0, .x2 = width, .y2 = height };
 
 	mpro -> info.width = width;
 	mpro -> info.height = height;
@@ -151,29 +137,7 @@ static void mpro_create_info(struct mpro_device *mpro, unsigned int width, unsig
 	mpro -> info.rect = rect;
 }
 
-int mpro_mode(struct mpro_device *mpro) {
-
-	struct drm_device *dev = &mpro -> dev;
-	const struct drm_format_info *format;
-	int stride, ret;
-
-	ret = mpro_get_screen(mpro);
-	if ( ret ) {
-		drm_err(&mpro->dev, "can't get screen info.\n");
-		return ret;
-	}
-
-	ret = mpro_get_version(mpro);
-	if ( ret ) {
-		drm_err(&mpro->dev, "can't get screen version.\n");
-		return ret;
-	}
-
-	ret = mpro_get_id(mpro);
-	if ( ret ) {
-		drm_err(&mpro->dev, "can't get screen id.\n");
-		return ret;
-	}
+static void mpro_model_derive(struct mpro_device *mpro) {
 
 	switch ( mpro -> screen ) {
 	case 0x00000005:
@@ -207,12 +171,26 @@ int mpro_mode(struct mpro_device *mpro) {
 		mpro_create_info(mpro, 480, 800, 0, 0, 0);
 	}
 
+	if ( mpro -> screen <= 2 )
+		mpro -> config.partial = -1;
+}
+
+int mpro_mode(struct mpro_device *mpro) {
+
+	struct drm_device *dev = &mpro -> dev;
+	const struct drm_format_info *format;
+	int stride, ret;
+
+	ret = mpro_identify(mpro);
+	if ( ret )
+		return ret;
+
+	mpro_model_derive(mpro);
+
 	drm_info(&mpro -> dev, "VoCore Screen found, model: %s", mpro -> info.model);
 
-	if ( mpro -> screen <= 2 ) {
-		mpro -> config.partial = -1;
+	if ( mpro -> config.partial < 0 )
 		drm_warn(&mpro -> dev, "device does not support partial frames");
-	}
 
 	const struct drm_display_mode mode = {
 		DRM_MODE_INIT(mpro -> info.hz, mpro -> info.width, mpro -> info.height, mpro -> info.width_mm, mpro -> info.height_mm)
@@ -240,11 +218,15 @@ int mpro_mode(struct mpro_device *mpro) {
 }
 
 static const struct drm_mode_config_funcs mpro_mode_config_funcs = {
-	.fb_create = drm_gem_fb_create_with_dirty,
+	.fb_create = mpro_fb_create,
 	.atomic_check = drm_atomic_helper_check,
 	.atomic_commit = drm_atomic_helper_commit,
 };
 
+static const struct drm_mode_config_helper_funcs mpro_mode_config_helper_funcs = {
+	.atomic_commit_tail = mpro_atomic_commit_tail,
+};
+
 int mpro_modeset(struct mpro_device* mpro) {
 
 	struct drm_device *dev = &mpro -> dev;
@@ -254,12 +236,19 @@ int mpro_modeset(struct mpro_device* mpro) {
 	if (ret)
 		return ret;
 
-	dev -> mode_config.min_width = mpro -> info.width;
-	dev -> mode_config.max_width = mpro -> info.width;
-	dev -> mode_config.min_height = mpro -> info.height;
-	dev -> mode_config.max_height = mpro -> info.height;
+	/*
+	 * framebuffers of a plane rotated by 90 or 270 degrees are transposed,
+	 * cursor framebuffers are smaller than the panel
+	 */
+	dev -> mode_config.min_width = 0;
+	dev -> mode_config.max_width = max(mpro -> info.width, mpro -> info.height);
+	dev -> mode_config.min_height = 0;
+	dev -> mode_config.max_height = max(mpro -> info.width, mpro -> info.height);
+	dev -> mode_config.cursor_width = MPRO_CURSOR_SIZE;
+	dev -> mode_config.cursor_height = MPRO_CURSOR_SIZE;
 	dev -> mode_config.preferred_depth = MPRO_BPP;
 	dev -> mode_config.funcs = &mpro_mode_config_funcs;
+	dev -> mode_config.helper_private = &mpro_mode_config_helper_funcs;
 
 	return 0;
 }
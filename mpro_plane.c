@@ -1,23 +1,126 @@
 /* SPDX-License-Identifier: MIT */
+#include <linux/mm.h>
+#include <linux/slab.h>
 #include <drm/drm_atomic.h>
+#include <drm/drm_blend.h>
 #include <drm/drm_plane_helper.h>
 #include <drm/drm_gem_atomic_helper.h>
 #include <drm/drm_gem_framebuffer_helper.h>
 #include <drm/drm_modeset_helper_vtables.h>
 #include <drm/drm_damage_helper.h>
+#include <drm/drm_fourcc.h>
 #include <drm/drm_print.h>
 #include "mpro.h"
+#include "mpro_trace.h"
+
+/* Convert dst_clip of the plane into dst, laid out with given pitch */
+static void mpro_convert(struct mpro_device *mpro, struct drm_plane_state *plane_state,
+			 struct iosys_map *dst, unsigned int *pitch, const struct drm_rect *dst_clip) {
+
+	struct drm_shadow_plane_state *shadow_plane_state = to_drm_shadow_plane_state(plane_state);
+	struct drm_framebuffer *fb = plane_state -> fb;
+	struct drm_rect src_clip = *dst_clip;
+	unsigned int rotation = mpro_rotation(mpro, plane_state);
+	unsigned int bytes = drm_rect_width(dst_clip) * drm_rect_height(dst_clip) * MPRO_BPP / 8;
+
+	trace_mpro_convert_start(mpro_minor(mpro), dst_clip, bytes);
+
+	mpro_rect_to_fb(plane_state, rotation, &src_clip);
+
+	mpro_fb_convert(mpro, to_mpro_plane_state(plane_state) -> kernels, dst, pitch,
+			shadow_plane_state -> data, fb, &src_clip, rotation);
+
+	trace_mpro_convert_end(mpro_minor(mpro), dst_clip, bytes);
+}
+
+/*
+ * Can a full frame update be sent from the framebuffer mapping without
+ * copying? The host controller has to take scatterlists, one entry per
+ * page at worst; mpro_frame_map() checks the merged entry count.
+ */
+static bool mpro_direct_possible(struct mpro_device *mpro, struct drm_plane_state *plane_state) {
+
+	struct drm_shadow_plane_state *shadow_plane_state = to_drm_shadow_plane_state(plane_state);
+	struct drm_framebuffer *fb = plane_state -> fb;
+	struct usb_device *udev = mpro_to_usb_device(mpro);
+
+	return fb -> format -> format == DRM_FORMAT_RGB565 &&
+	       fb -> pitches[0] == mpro -> pitch && fb -> offsets[0] == 0 &&
+	       plane_state -> src.x1 == 0 && plane_state -> src.y1 == 0 &&
+	       !shadow_plane_state -> data[0].is_iomem &&
+	       is_vmalloc_addr(shadow_plane_state -> data[0].vaddr) &&
+	       PAGE_ALIGNED(shadow_plane_state -> data[0].vaddr) &&
+	       mpro_rotation(mpro, plane_state) == DRM_MODE_ROTATE_0 &&
+	       !mpro_layers_visible(mpro) &&
+	       !mpro -> config.dirty && !mpro -> info.margin &&
+	       udev -> bus -> sg_tablesize > 0;
+}
+
+/*
+ * Full frame update sent while it is converted: the frame is queued
+ * before conversion and its payload is released to the bulk urbs every
+ * MPRO_STREAM_LINES lines, so conversion overlaps the transfer.
+ */
+static void mpro_stream(struct mpro_device *mpro, struct mpro_frame *frame,
+			struct drm_plane_state *plane_state, struct mpro_damage *d) {
+
+	struct drm_rect area = { };
+	struct iosys_map dst;
+	unsigned int i;
+	int y;
+
+	for ( i = 0; i < d -> nrects; i++ )
+		mpro_rect_union(&area, &d -> rects[i]);
+
+	frame -> ready = 0;
+	mpro_blit(mpro, frame, &mpro -> info.rect);
+	if ( mpro_frame_flush(mpro, frame, &area))
+		return;
+
+	for ( y = 0; y < mpro -> info.height; y += MPRO_STREAM_LINES ) {
+
+		struct drm_rect band = DRM_RECT_INIT(0, y, mpro -> info.width,
+						     min(MPRO_STREAM_LINES, mpro -> info.height - y));
+
+		for ( i = 0; i < d -> nrects; i++ ) {
+
+			struct drm_rect clip = d -> rects[i];
+
+			if ( !drm_rect_intersect(&clip, &band))
+				continue;
+
+			iosys_map_set_vaddr(&dst, frame -> data);
+			iosys_map_incr(&dst, drm_fb_clip_offset(mpro -> pitch, mpro -> format, &clip));
+			mpro_convert(mpro, plane_state, &dst, &mpro -> pitch, &clip);
+			mpro_layers_blend(mpro, dst.vaddr, mpro -> pitch, &clip);
+		}
+
+		mpro_frame_ready(mpro, frame, band.y2 * mpro -> pitch);
+	}
+
+	// trailing margin of some panels
+	mpro_frame_ready(mpro, frame, mpro -> block_size);
+}
 
 static void mpro_primary_plane_helper_atomic_update(struct drm_plane *plane, struct drm_atomic_state *state) {
 
 	struct drm_plane_state *plane_state = drm_atomic_get_new_plane_state(state, plane);
 	struct drm_plane_state *old_plane_state = drm_atomic_get_old_plane_state(state, plane);
 	struct drm_shadow_plane_state *shadow_plane_state = to_drm_shadow_plane_state(plane_state);
+	struct mpro_plane_state *mpro_plane_state = to_mpro_plane_state(plane_state);
 	struct drm_framebuffer *fb = plane_state -> fb;
 	struct drm_device *dev = plane -> dev;
 	struct mpro_device *mpro = to_mpro(dev);
 	struct drm_atomic_helper_damage_iter iter;
-	struct drm_rect damage;
+	struct mpro_damage *d = &mpro -> damage;
+	struct drm_rect damage, area = { };
+	struct mpro_frame *frame;
+	struct iosys_map dst;
+	ktime_t convert_start;
+	unsigned int i;
+	unsigned int rotation;
+	bool direct, repeat;
+	int partial;
 	int idx;
 
 	if ( drm_gem_fb_begin_cpu_access(fb, DMA_FROM_DEVICE))
@@ -26,31 +129,158 @@ static void mpro_primary_plane_helper_atomic_update(struct drm_plane *plane, str
 	if ( !drm_dev_enter(dev, &idx))
 		goto out_drm_gem_fb_end_cpu_access;
 
-	drm_atomic_helper_damage_iter_init(&iter, old_plane_state, plane_state);
-	drm_atomic_for_each_plane_damage(&iter, &damage) {
+	mutex_lock(&mpro -> config_lock);
+
+	frame = mpro_frame_begin(mpro);
+	if ( IS_ERR(frame))
+		goto out_mutex_unlock;
+
+	mpro_damage_init(d);
+	rotation = mpro_rotation(mpro, plane_state);
+	partial = mpro -> config.partial;
+
+	// framebuffer is unchanged when only layers changed, their rects go out as partial updates
+	if ( mpro_plane_state -> layers_only ) {
+		if ( partial == MPRO_PARTIAL_OFF )
+			partial = MPRO_PARTIAL_ON;
+	} else {
+		drm_atomic_helper_damage_iter_init(&iter, old_plane_state, plane_state);
+		drm_atomic_for_each_plane_damage(&iter, &damage) {
+
+			// damage is in framebuffer coordinates, clipped to plane source
+			mpro_rect_to_panel(plane_state, rotation, &damage);
+			mpro_damage_add(mpro, d, &damage);
+		}
+	}
+
+	mpro_perf_add(mpro, MPRO_PERF_DAMAGE_PIXELS, d -> pixels);
+
+	if ( trace_mpro_damage_enabled()) {
+
+		struct drm_rect bounds = { };
+
+		for ( i = 0; i < d -> nrects; i++ )
+			mpro_rect_union(&bounds, &d -> rects[i]);
+
+		trace_mpro_damage(mpro_minor(mpro), d -> nrects, d -> pixels, &bounds);
+	}
+
+	direct = mpro_direct_possible(mpro, plane_state);
+
+	// new orientation moves every pixel
+	if ( plane_state -> rotation != old_plane_state -> rotation )
+		mpro -> redraw = true;
+
+	// frames lack the last directly sent framebuffer, or a tunable changed the layout, rebuild them
+	if (( mpro -> resync && !direct ) || mpro -> redraw ) {
+		mpro_damage_init(d);
+		mpro_damage_add(mpro, d, &plane_state -> dst);
+		mpro -> redraw = false;
+	}
+
+	// what changed in the layers on top, a flipx change moves them too
+	mpro_layers_damage(mpro, d);
+
+	convert_start = ktime_get();
+
+	/*
+	 * Same framebuffer again is what a compositor or fbdev repeating
+	 * itself commits, with or without damage clips; with suppression the
+	 * damage is compared like in dirty mode and nothing is sent when no
+	 * pixel changed.
+	 */
+	repeat = mpro -> config.suppress && fb == old_plane_state -> fb && !mpro_plane_state -> layers_only;
+
+	// dirty mode: convert aside and keep only what differs from the last frame
+	if (( mpro -> config.dirty || repeat ) && mpro -> conv && d -> nrects && !mpro -> resync ) {
+
+		struct mpro_damage *dirty = &mpro -> dirty;
+
+		mpro_damage_init(dirty);
+
+		for ( i = 0; i < d -> nrects; i++ ) {
+
+			unsigned int pitch = drm_rect_width(&d -> rects[i]) * MPRO_BPP / 8;
 
-		struct drm_rect dst_clip = plane_state -> dst;
-		struct iosys_map dst = mpro -> screen_base;
+			iosys_map_set_vaddr(&dst, mpro -> conv);
+			mpro_convert(mpro, plane_state, &dst, &pitch, &d -> rects[i]);
+			mpro_layers_blend(mpro, mpro -> conv, pitch, &d -> rects[i]);
+			mpro_damage_diff(mpro, dirty, frame -> data, mpro -> conv, &d -> rects[i]);
+		}
 
-		if ( !drm_rect_intersect(&dst_clip, &damage))
-			continue;
+		if ( !dirty -> nrects )
+			mpro_perf_add(mpro, MPRO_PERF_UNCHANGED, 1);
 
-		iosys_map_incr(&dst, drm_fb_clip_offset(mpro -> pitch, mpro -> format, &dst_clip));
+		d = dirty;
+	}
+
+	if ( partial > 0 )
+		mpro_damage_optimize(mpro, d);
+
+	// rgb565 framebuffer in device layout goes out as it is
+	if (( partial < 1 || d -> full ) && d -> nrects && direct ) {
+
+		if ( !mpro_blit_direct(mpro, frame, shadow_plane_state -> data[0].vaddr)) {
+			mpro -> resync = true;
+			goto out_mpro_frame_flush;
+		}
+
+		// could not map it, full frame is sent from the staging buffer
+		mpro_damage_init(d);
+		mpro_damage_add(mpro, d, &plane_state -> dst);
+		d -> full = true;
+		direct = false;
+	}
+
+	// partial updates only need the damaged rects to be current
+	if ( !direct )
+		mpro -> resync = false;
 
-		if ( mpro -> config.flipx )
-			drm_fb_xrgb8888_to_rgb565_flipped(&dst, &mpro -> pitch, shadow_plane_state -> data, fb, &damage, false);
-		else
-			drm_fb_xrgb8888_to_rgb565(&dst, &mpro -> pitch, shadow_plane_state -> data, fb, &damage, false);
+	// full frame update goes on the wire while it is converted
+	if ( mpro -> config.stream && d != &mpro -> dirty && ( partial < 1 || d -> full ) && d -> nrects ) {
+		mpro_stream(mpro, frame, plane_state, d);
+		mpro_perf_latency(mpro, MPRO_LAT_CONVERT, ktime_to_ns(ktime_sub(ktime_get(), convert_start)));
+		goto out_mutex_unlock;
+	}
+
+	for ( i = 0; i < d -> nrects; i++ ) {
+
+		struct drm_rect *dst_clip = &d -> rects[i];
+
+		if ( d != &mpro -> dirty ) {
+			iosys_map_set_vaddr(&dst, frame -> data);
+			iosys_map_incr(&dst, drm_fb_clip_offset(mpro -> pitch, mpro -> format, dst_clip));
+			mpro_convert(mpro, plane_state, &dst, &mpro -> pitch, dst_clip);
+			mpro_layers_blend(mpro, dst.vaddr, mpro -> pitch, dst_clip);
+		}
+
+		mpro_rect_union(&area, dst_clip);
 
 		// partial frame updates:
-		if ( mpro -> config.partial > 0 )
-			mpro_blit(mpro, &damage);
+		if ( partial > 0 && !d -> full )
+			mpro_blit(mpro, frame, dst_clip);
 	}
 
+	mpro_perf_latency(mpro, MPRO_LAT_CONVERT, ktime_to_ns(ktime_sub(ktime_get(), convert_start)));
+
+	/*
+	 * Queued frame was taken back or dropped: its rects are in frame -> data
+	 * already and go out as they are, converting them again would replace
+	 * pixels of a direct flush with those of the framebuffer.
+	 */
+	if ( partial > 0 && !d -> full )
+		for ( i = 0; i < frame -> ncarry; i++ )
+			mpro_blit(mpro, frame, &frame -> carry[i]);
+
 	// fullscreen frame update:
-	if ( mpro -> config.partial < 1 )
-		mpro_blit(mpro, &mpro -> info.rect);
+	if (( partial < 1 || d -> full ) && ( drm_rect_visible(&area) || frame -> ncarry ))
+		mpro_blit(mpro, frame, &mpro -> info.rect);
 
+out_mpro_frame_flush:
+	mpro_frame_flush(mpro, frame, &area);
+
+out_mutex_unlock:
+	mutex_unlock(&mpro -> config_lock);
 	drm_dev_exit(idx);
 
 out_drm_gem_fb_end_cpu_access:
@@ -61,31 +291,108 @@ static void mpro_primary_plane_helper_atomic_disable(struct drm_plane *plane, st
 
 	struct drm_device *dev = plane -> dev;
 	struct mpro_device *mpro = to_mpro(dev);
+	struct drm_rect area = DRM_RECT_INIT(0, 0, mpro -> info.width, mpro -> info.height);
+	struct mpro_frame *frame;
 	int idx;
 
 	if ( !drm_dev_enter(dev, &idx))
 		return;
 
+	mutex_lock(&mpro -> config_lock);
+
+	frame = mpro_frame_begin(mpro);
+	if ( IS_ERR(frame))
+		goto out_mutex_unlock;
+
 	/* Clear screen to black on disable */
-	iosys_map_memset(&mpro -> screen_base, 0, 0, mpro -> block_size);
-	//memset(mpro -> data, 0xff, mpro -> block_size);
-	mpro_blit(mpro, &mpro -> info.rect);
+	memset(frame -> data, 0, mpro -> block_size);
+	mpro -> resync = false;
+	mpro_layers_reset(mpro);
+	mpro_blit(mpro, frame, &mpro -> info.rect);
+	mpro_frame_flush(mpro, frame, &area);
 
+out_mutex_unlock:
+	mutex_unlock(&mpro -> config_lock);
 	drm_dev_exit(idx);
 }
 
+static int mpro_primary_plane_helper_atomic_check(struct drm_plane *plane, struct drm_atomic_state *state) {
+
+	struct mpro_device *mpro = to_mpro(plane -> dev);
+	struct drm_plane_state *plane_state = drm_atomic_get_new_plane_state(state, plane);
+	struct mpro_plane_state *mpro_plane_state = to_mpro_plane_state(plane_state);
+	int ret;
+
+	ret = drm_plane_helper_atomic_check(plane, state);
+	if ( ret || !plane_state -> fb )
+		return ret;
+
+	/* the conversion kernels for this framebuffer are picked here, once */
+	mpro_plane_state -> kernels = mpro_kernels_lookup(mpro, plane_state -> fb);
+	if ( !mpro_plane_state -> kernels ) {
+		drm_dbg(plane -> dev, "no conversion for format %p4cc\n", &plane_state -> fb -> format -> format);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 static const struct drm_plane_helper_funcs mpro_primary_plane_helper_funcs = {
-	DRM_GEM_SHADOW_PLANE_HELPER_FUNCS,
-	.atomic_check = drm_plane_helper_atomic_check,
+	.begin_fb_access = mpro_fb_begin_access,
+	.end_fb_access = mpro_fb_end_access,
+	.atomic_check = mpro_primary_plane_helper_atomic_check,
 	.atomic_update = mpro_primary_plane_helper_atomic_update,
 	.atomic_disable = mpro_primary_plane_helper_atomic_disable,
 };
 
+static void mpro_primary_plane_reset(struct drm_plane *plane) {
+
+	struct mpro_plane_state *mpro_plane_state;
+
+	if ( plane -> state ) {
+		__drm_gem_destroy_shadow_plane_state(to_drm_shadow_plane_state(plane -> state));
+		kfree(to_mpro_plane_state(plane -> state));
+		plane -> state = NULL;
+	}
+
+	mpro_plane_state = kzalloc(sizeof(*mpro_plane_state), GFP_KERNEL);
+	if ( !mpro_plane_state )
+		return;
+
+	__drm_gem_reset_shadow_plane(plane, &mpro_plane_state -> base);
+}
+
+static struct drm_plane_state *mpro_primary_plane_duplicate_state(struct drm_plane *plane) {
+
+	struct mpro_plane_state *mpro_plane_state;
+
+	if ( !plane -> state )
+		return NULL;
+
+	mpro_plane_state = kzalloc(sizeof(*mpro_plane_state), GFP_KERNEL);
+	if ( !mpro_plane_state )
+		return NULL;
+
+	__drm_gem_duplicate_shadow_plane_state(plane, &mpro_plane_state -> base);
+	mpro_plane_state -> kernels = to_mpro_plane_state(plane -> state) -> kernels;
+	mpro_plane_state -> layers_only = false;
+
+	return &mpro_plane_state -> base.base;
+}
+
+static void mpro_primary_plane_destroy_state(struct drm_plane *plane, struct drm_plane_state *plane_state) {
+
+	__drm_gem_destroy_shadow_plane_state(to_drm_shadow_plane_state(plane_state));
+	kfree(to_mpro_plane_state(plane_state));
+}
+
 static const struct drm_plane_funcs mpro_primary_plane_funcs = {
 	.update_plane = drm_atomic_helper_update_plane,
 	.disable_plane = drm_atomic_helper_disable_plane,
 	.destroy = drm_plane_cleanup,
-	DRM_GEM_SHADOW_PLANE_FUNCS,
+	.reset = mpro_primary_plane_reset,
+	.atomic_duplicate_state = mpro_primary_plane_duplicate_state,
+	.atomic_destroy_state = mpro_primary_plane_destroy_state,
 };
 
 int mpro_init_planes(struct mpro_device *mpro) {
@@ -93,10 +400,19 @@ int mpro_init_planes(struct mpro_device *mpro) {
 	struct drm_device *dev = &mpro -> dev;
 	struct drm_plane *primary_plane = &mpro -> primary_plane;
 	const struct drm_format_info *format = mpro -> format;
-	size_t nformats;
+	unsigned int i, nformats = 0;
 	int ret;
 
-	nformats = drm_fb_build_fourcc_list(dev, &format -> format, 1, mpro -> formats, ARRAY_SIZE(mpro -> formats));
+	/* overlays and cursor go first, see mpro_layer.c */
+	ret = mpro_init_layers(mpro);
+	if ( ret )
+		return ret;
+
+	/* native format first, then everything that has a converter to it */
+	mpro -> formats[nformats++] = format -> format;
+	for ( i = 0; i < ARRAY_SIZE(mpro_formats) && nformats < ARRAY_SIZE(mpro -> formats); i++ )
+		if ( mpro_formats[i] != format -> format )
+			mpro -> formats[nformats++] = mpro_formats[i];
 
 	ret = drm_universal_plane_init(dev, primary_plane, 0, &mpro_primary_plane_funcs,
 				       mpro -> formats, nformats,
@@ -108,5 +424,14 @@ int mpro_init_planes(struct mpro_device *mpro) {
 	drm_plane_helper_add(primary_plane, &mpro_primary_plane_helper_funcs);
 	drm_plane_enable_fb_damage_clips(primary_plane);
 
-	return 0;
+	/* rotation is done while converting, see mpro_fb_convert() */
+	ret = drm_plane_create_rotation_property(primary_plane, DRM_MODE_ROTATE_0,
+						 DRM_MODE_ROTATE_0 | DRM_MODE_ROTATE_90 |
+						 DRM_MODE_ROTATE_180 | DRM_MODE_ROTATE_270 |
+						 DRM_MODE_REFLECT_X | DRM_MODE_REFLECT_Y);
+	if ( ret )
+		return ret;
+
+	/* everything else is composed on top */
+	return drm_plane_create_zpos_immutable_property(primary_plane, 0);
 }
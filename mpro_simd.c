@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: MIT */
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include "mpro.h"
+
+/*
+ * Vectorized xrgb8888 to rgb565 line converters. This file is built
+ * with the fpu/neon flags of the architecture, so it holds nothing but
+ * the line kernels; callers must wrap them in kernel_fpu_begin() or
+ * kernel_neon_begin(), see mpro_convert_band().
+ *
+ * Kernels are written with compiler vector extensions, one register
+ * of pixels at a time: 4 with sse2 and neon, 8 with avx2. Leftover
+ * pixels go through the scalar expression. The mirrored variants
+ * reverse the packed vector in register and store it from the end of
+ * the line. __builtin_convertvector() needs gcc 9 or clang, older
+ * compilers get the scalar converters only, see MPRO_SIMD_X86 and
+ * MPRO_SIMD_NEON.
+ */
+
+#define MPRO_RGB565(p) \
+	((((p) >> 8) & 0xf800) | (((p) >> 5) & 0x07e0) | (((p) >> 3) & 0x001f))
+
+#ifdef __clang__
+#define MPRO_REVERSE4(v) \
+	__builtin_shufflevector(v, v, 3, 2, 1, 0)
+#define MPRO_REVERSE8(v) \
+	__builtin_shufflevector(v, v, 7, 6, 5, 4, 3, 2, 1, 0)
+#else
+#define MPRO_REVERSE4(v) \
+	__builtin_shuffle(v, (typeof(v)){ 3, 2, 1, 0 })
+#define MPRO_REVERSE8(v) \
+	__builtin_shuffle(v, (typeof(v)){ 7, 6, 5, 4, 3, 2, 1, 0 })
+#endif
+
+#define MPRO_DEFINE_LINE(suffix, lanes, attr) \
+typedef u32 mpro_v32_##suffix __attribute__((vector_size((lanes) * 4))); \
+typedef u16 mpro_v16_##suffix __attribute__((vector_size((lanes) * 2))); \
+\
+attr void mpro_xrgb8888_to_rgb565_line_##suffix(void *dbuf, const void *sbuf, unsigned int pixels) { \
+\
+	u16 *dbuf16 = dbuf; \
+	const u32 *sbuf32 = sbuf; \
+	unsigned int x = 0; \
+\
+	for ( ; x + (lanes) <= pixels; x += (lanes)) { \
+		mpro_v32_##suffix pix; \
+		mpro_v16_##suffix val; \
+\
+		memcpy(&pix, sbuf32 + x, sizeof(pix)); \
+		val = __builtin_convertvector(MPRO_RGB565(pix), mpro_v16_##suffix); \
+		memcpy(dbuf16 + x, &val, sizeof(val)); \
+	} \
+\
+	for ( ; x < pixels; x++ ) \
+		dbuf16[x] = MPRO_RGB565(sbuf32[x]); \
+} \
+\
+attr void mpro_xrgb8888_to_rgb565_line_flipped_##suffix(void *dbuf, const void *sbuf, unsigned int pixels) { \
+\
+	u16 *dbuf16 = dbuf; \
+	const u32 *sbuf32 = sbuf; \
+	unsigned int x = 0; \
+\
+	for ( ; x + (lanes) <= pixels; x += (lanes)) { \
+		mpro_v32_##suffix pix; \
+		mpro_v16_##suffix val; \
+\
+		memcpy(&pix, sbuf32 + x, sizeof(pix)); \
+		val = __builtin_convertvector(MPRO_RGB565(pix), mpro_v16_##suffix); \
+		val = MPRO_REVERSE##lanes(val); \
+		memcpy(dbuf16 + pixels - x - (lanes), &val, sizeof(val)); \
+	} \
+\
+	for ( ; x < pixels; x++ ) \
+		dbuf16[pixels - 1 - x] = MPRO_RGB565(sbuf32[x]); \
+}
+
+#if defined(MPRO_SIMD_X86)
+MPRO_DEFINE_LINE(sse2, 4, )
+MPRO_DEFINE_LINE(avx2, 8, __attribute__((target("avx2"))))
+#elif defined(MPRO_SIMD_NEON)
+MPRO_DEFINE_LINE(neon, 4, )
+#endif
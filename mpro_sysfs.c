@@ -18,12 +18,78 @@ static ssize_t flipx_read(struct device* dev, struct device_attribute *attr, cha
 	return sprintf(buf, "%d\n", mpro -> config.flipx);
 }
 
+static ssize_t mpro_tunable_write(struct device *dev, enum mpro_tunable tunable, const char *buf, size_t count) {
+
+	struct mpro_device *mpro = dev_get_drvdata(dev);
+	unsigned int value;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &value);
+	if ( ret )
+		return ret;
+
+	ret = mpro_config_set(mpro, tunable, value);
+	if ( ret )
+		return ret;
+
+	mpro_connector_sync(mpro, tunable);
+
+	return count;
+}
+
+static ssize_t partial_write(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+
+	return mpro_tunable_write(dev, MPRO_TUNE_PARTIAL, buf, count);
+}
+
+static ssize_t flipx_write(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+
+	return mpro_tunable_write(dev, MPRO_TUNE_FLIPX, buf, count);
+}
+
+static ssize_t threshold_read(struct device* dev, struct device_attribute *attr, char *buf) {
+
+	struct mpro_device *mpro = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", mpro_config_get(mpro, MPRO_TUNE_THRESHOLD));
+}
+
+static ssize_t threshold_write(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+
+	return mpro_tunable_write(dev, MPRO_TUNE_THRESHOLD, buf, count);
+}
+
+static ssize_t chunk_read(struct device* dev, struct device_attribute *attr, char *buf) {
+
+	struct mpro_device *mpro = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", mpro_config_get(mpro, MPRO_TUNE_CHUNK));
+}
+
+static ssize_t chunk_write(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+
+	return mpro_tunable_write(dev, MPRO_TUNE_CHUNK, buf, count);
+}
+
+static ssize_t hz_read(struct device* dev, struct device_attribute *attr, char *buf) {
+
+	struct mpro_device *mpro = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", mpro_config_get(mpro, MPRO_TUNE_HZ));
+}
+
+static ssize_t hz_write(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+
+	return mpro_tunable_write(dev, MPRO_TUNE_HZ, buf, count);
+}
+
 static struct device_attribute partial_attr = {
 	.attr = {
 		.name = "partial_updates",
 		.mode = S_IWUSR | S_IRUGO,
 	},
 	.show = partial_read,
+	.store = partial_write,
 };
 
 static struct device_attribute flipx_attr = {
@@ -32,19 +98,56 @@ static struct device_attribute flipx_attr = {
 		.mode = S_IWUSR | S_IRUGO,
 	},
 	.show = flipx_read,
+	.store = flipx_write,
 };
 
-int mpro_init_sysfs(struct mpro_device *mpro) {
+static struct device_attribute threshold_attr = {
+	.attr = {
+		.name = "damage_threshold",
+		.mode = S_IWUSR | S_IRUGO,
+	},
+	.show = threshold_read,
+	.store = threshold_write,
+};
 
-	int ret;
+static struct device_attribute chunk_attr = {
+	.attr = {
+		.name = "chunk_size",
+		.mode = S_IWUSR | S_IRUGO,
+	},
+	.show = chunk_read,
+	.store = chunk_write,
+};
 
-	ret = sysfs_create_file(&mpro -> dev.dev -> kobj, &partial_attr.attr);
-        if ( ret )
-		return ret;
+static struct device_attribute hz_attr = {
+	.attr = {
+		.name = "pacing_hz",
+		.mode = S_IWUSR | S_IRUGO,
+	},
+	.show = hz_read,
+	.store = hz_write,
+};
 
-	ret = sysfs_create_file(&mpro -> dev.dev -> kobj, &flipx_attr.attr);
-	if ( ret )
-		return ret;
+static struct attribute *mpro_attrs[] = {
+	&partial_attr.attr,
+	&flipx_attr.attr,
+	&threshold_attr.attr,
+	&chunk_attr.attr,
+	&hz_attr.attr,
+	NULL,
+};
+
+static const struct attribute_group mpro_attr_group = {
+	.attrs = mpro_attrs,
+};
+
+int mpro_init_sysfs(struct mpro_device *mpro) {
+
+	return sysfs_create_group(&mpro -> dev.dev -> kobj, &mpro_attr_group);
+}
+
+/* Before unplug: removal waits for running handlers, later ones can't reach mpro */
+void mpro_remove_sysfs(struct mpro_device *mpro) {
 
-	return 0;
+	sysfs_remove_group(&mpro -> dev.dev -> kobj, &mpro_attr_group);
 }
@@ -0,0 +1,169 @@
+/* SPDX-License-Identifier: MIT */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mpro
+
+#if !defined(_MPRO_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _MPRO_TRACE_H_
+
+#include <linux/tracepoint.h>
+#include <drm/drm_rect.h>
+
+/*
+ * Events along one frame: damage collected by the plane update, pixel
+ * conversion of each rect, draw commands queued and submitted, bulk
+ * payload chunks and dropped frames. Every event carries the drm minor
+ * so traces of several panels can be told apart.
+ */
+
+TRACE_EVENT(mpro_damage,
+	TP_PROTO(unsigned int minor, unsigned int nrects, unsigned long pixels, const struct drm_rect *bounds),
+	TP_ARGS(minor, nrects, pixels, bounds),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, nrects)
+		__field(unsigned long, pixels)
+		__field(int, x1)
+		__field(int, y1)
+		__field(int, x2)
+		__field(int, y2)
+	),
+
+	TP_fast_assign(
+		__entry -> minor = minor;
+		__entry -> nrects = nrects;
+		__entry -> pixels = pixels;
+		__entry -> x1 = bounds -> x1;
+		__entry -> y1 = bounds -> y1;
+		__entry -> x2 = bounds -> x2;
+		__entry -> y2 = bounds -> y2;
+	),
+
+	TP_printk("minor=%u rects=%u pixels=%lu bounds=%d,%d-%d,%d",
+		  __entry -> minor, __entry -> nrects, __entry -> pixels,
+		  __entry -> x1, __entry -> y1, __entry -> x2, __entry -> y2)
+);
+
+DECLARE_EVENT_CLASS(mpro_rect,
+	TP_PROTO(unsigned int minor, const struct drm_rect *rect, unsigned int bytes),
+	TP_ARGS(minor, rect, bytes),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, x1)
+		__field(int, y1)
+		__field(int, x2)
+		__field(int, y2)
+		__field(unsigned int, bytes)
+	),
+
+	TP_fast_assign(
+		__entry -> minor = minor;
+		__entry -> x1 = rect -> x1;
+		__entry -> y1 = rect -> y1;
+		__entry -> x2 = rect -> x2;
+		__entry -> y2 = rect -> y2;
+		__entry -> bytes = bytes;
+	),
+
+	TP_printk("minor=%u rect=%d,%d-%d,%d bytes=%u",
+		  __entry -> minor, __entry -> x1, __entry -> y1, __entry -> x2, __entry -> y2, __entry -> bytes)
+);
+
+DEFINE_EVENT(mpro_rect, mpro_convert_start,
+	TP_PROTO(unsigned int minor, const struct drm_rect *rect, unsigned int bytes),
+	TP_ARGS(minor, rect, bytes)
+);
+
+DEFINE_EVENT(mpro_rect, mpro_convert_end,
+	TP_PROTO(unsigned int minor, const struct drm_rect *rect, unsigned int bytes),
+	TP_ARGS(minor, rect, bytes)
+);
+
+/* one band of a rect converted by a worker or the commit thread */
+DEFINE_EVENT(mpro_rect, mpro_convert_band,
+	TP_PROTO(unsigned int minor, const struct drm_rect *rect, unsigned int bytes),
+	TP_ARGS(minor, rect, bytes)
+);
+
+/* draw command added to a frame by mpro_blit() */
+DEFINE_EVENT(mpro_rect, mpro_cmd_queue,
+	TP_PROTO(unsigned int minor, const struct drm_rect *rect, unsigned int bytes),
+	TP_ARGS(minor, rect, bytes)
+);
+
+/* cmd_draw control message handed to usb */
+DEFINE_EVENT(mpro_rect, mpro_cmd_submit,
+	TP_PROTO(unsigned int minor, const struct drm_rect *rect, unsigned int bytes),
+	TP_ARGS(minor, rect, bytes)
+);
+
+TRACE_EVENT(mpro_bulk_start,
+	TP_PROTO(unsigned int minor, unsigned int cmd, unsigned int offset, unsigned int len),
+	TP_ARGS(minor, cmd, offset, len),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, cmd)
+		__field(unsigned int, offset)
+		__field(unsigned int, len)
+	),
+
+	TP_fast_assign(
+		__entry -> minor = minor;
+		__entry -> cmd = cmd;
+		__entry -> offset = offset;
+		__entry -> len = len;
+	),
+
+	TP_printk("minor=%u cmd=%u offset=%u len=%u",
+		  __entry -> minor, __entry -> cmd, __entry -> offset, __entry -> len)
+);
+
+TRACE_EVENT(mpro_bulk_done,
+	TP_PROTO(unsigned int minor, unsigned int cmd, unsigned int actual, int status),
+	TP_ARGS(minor, cmd, actual, status),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, cmd)
+		__field(unsigned int, actual)
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		__entry -> minor = minor;
+		__entry -> cmd = cmd;
+		__entry -> actual = actual;
+		__entry -> status = status;
+	),
+
+	TP_printk("minor=%u cmd=%u actual=%u status=%d",
+		  __entry -> minor, __entry -> cmd, __entry -> actual, __entry -> status)
+);
+
+TRACE_EVENT(mpro_frame_drop,
+	TP_PROTO(unsigned int minor, int status),
+	TP_ARGS(minor, status),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		__entry -> minor = minor;
+		__entry -> status = status;
+	),
+
+	TP_printk("minor=%u status=%d", __entry -> minor, __entry -> status)
+);
+
+#endif /* _MPRO_TRACE_H_ */
+
+/* out of tree module, the header is found through -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mpro_trace
+#include <trace/define_trace.h>
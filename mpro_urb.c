@@ -0,0 +1,964 @@
+/* SPDX-License-Identifier: MIT */
+#include <linux/dma-fence.h>
+#include <linux/usb.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <drm/drm_managed.h>
+#include <drm/drm_vblank.h>
+#include <drm/drm_print.h>
+#include <drm/drm_rect.h>
+#include "mpro.h"
+#include "mpro_trace.h"
+
+/*
+ * Frames are sent as a chain of (cmd_draw control message, bulk payload)
+ * pairs. Only one frame is on the wire at a time; the next one waits in
+ * mpro -> pending and is started from the completion handler of the
+ * previous one, so conversion of the back buffer overlaps the transfer
+ * of the front buffer and atomic commits never block on usb.
+ *
+ * Payloads go out in bulk urbs of config.chunk bytes. Each urb on the
+ * wire is watched by xfer_timer with a timeout scaled by its length and
+ * the measured link rate; a failed command is sent again a few times,
+ * and rects of a frame that is dropped after all go out with the next.
+ *
+ * Every frame flushed holds a runtime pm reference of the interface
+ * until it is done, so the device autosuspends only when idle.
+ */
+
+static void mpro_frame_done(struct mpro_frame *frame, int status);
+
+static const char *mpro_fence_get_driver_name(struct dma_fence *fence) {
+	return "mpro";
+}
+
+static const char *mpro_fence_get_timeline_name(struct dma_fence *fence) {
+	return "flush";
+}
+
+static const struct dma_fence_ops mpro_fence_ops = {
+	.get_driver_name = mpro_fence_get_driver_name,
+	.get_timeline_name = mpro_fence_get_timeline_name,
+};
+
+/*
+ * Out fence of frame, created on first use. A frame taken back by a
+ * newer commit keeps its fence, which then signals with the merged one.
+ * Caller gets its own reference.
+ */
+struct dma_fence *mpro_frame_fence(struct mpro_device *mpro, struct mpro_frame *frame) {
+
+	struct dma_fence *fence = frame -> fence;
+
+	if ( !fence ) {
+		fence = kzalloc(sizeof(*fence), GFP_KERNEL);
+		if ( !fence )
+			return NULL;
+
+		dma_fence_init(fence, &mpro_fence_ops, &mpro -> fence_lock,
+			       mpro -> fence_context, ++mpro -> fence_seqno);
+		frame -> fence = fence;
+	}
+
+	return dma_fence_get(fence);
+}
+
+/* Signal and drop the out fence of frame, if it has one; safe from any context */
+static void mpro_frame_signal(struct mpro_frame *frame, int status) {
+
+	struct dma_fence *fence = xchg(&frame -> fence, NULL);
+
+	if ( !fence )
+		return;
+
+	if ( status )
+		dma_fence_set_error(fence, status);
+
+	dma_fence_signal(fence);
+	dma_fence_put(fence);
+}
+
+/* Drop the runtime pm reference of frame, if it holds one; safe from any context */
+static void mpro_frame_idle_pm(struct mpro_frame *frame) {
+
+	struct mpro_device *mpro = frame -> mpro;
+
+	if ( xchg(&frame -> pm, 0))
+		usb_autopm_put_interface_async(to_usb_interface(mpro -> dev.dev));
+}
+
+/*
+ * Longest an urb of len bytes may stay on the wire: the control message
+ * delay as slack plus a margin over its time at the measured link rate.
+ */
+static u64 mpro_xfer_timeout(struct mpro_device *mpro, unsigned int len) {
+
+	u64 rate = READ_ONCE(mpro -> rate) ?: MPRO_RATE_FLOOR;
+
+	return (u64)MPRO_MAX_DELAY * NSEC_PER_MSEC + MPRO_XFER_MARGIN * div64_u64((u64)len * NSEC_PER_SEC, rate);
+}
+
+/* Bound on waiting for a frame on the wire, with every urb of it retried */
+static unsigned long mpro_frame_timeout(struct mpro_device *mpro) {
+
+	unsigned int chunk = mpro -> config.chunk ?: mpro -> block_size;
+	u64 ns = mpro_xfer_timeout(mpro, mpro -> block_size) +
+		 (u64)(MPRO_MAX_CMDS + DIV_ROUND_UP(mpro -> block_size, chunk)) * MPRO_MAX_DELAY * NSEC_PER_MSEC;
+
+	return nsecs_to_jiffies((MPRO_XFER_RETRIES + 1) * ns);
+}
+
+/*
+ * The watchdog is armed with a sequence number, which moves on once the
+ * urb completes; an expiry that fires after that, or while the timer is
+ * armed again for the next urb, belongs to an urb that is gone.
+ */
+static void mpro_xfer_arm(struct mpro_device *mpro, unsigned int len) {
+
+	unsigned long flags;
+
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+	mpro -> xfer_armed = ++mpro -> xfer_seq;
+	hrtimer_start(&mpro -> xfer_timer, ns_to_ktime(mpro_xfer_timeout(mpro, len)), HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+}
+
+static void mpro_xfer_disarm(struct mpro_device *mpro) {
+
+	unsigned long flags;
+
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+	mpro -> xfer_seq++;
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	hrtimer_try_to_cancel(&mpro -> xfer_timer);
+}
+
+/* Urb overdue, unlink it; the completion handler sees -ETIMEDOUT */
+static enum hrtimer_restart mpro_xfer_timer(struct hrtimer *timer) {
+
+	struct mpro_device *mpro = container_of(timer, struct mpro_device, xfer_timer);
+	struct mpro_frame *frame = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+	if ( mpro -> xfer_armed == mpro -> xfer_seq && !hrtimer_is_queued(timer)) {
+		frame = mpro -> active;
+		if ( frame )
+			frame -> timedout = true;
+	}
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	if ( frame ) {
+		mpro_perf_add(mpro, MPRO_PERF_TIMEOUTS, 1);
+		usb_unlink_urb(frame -> ctrl_urb);
+		usb_unlink_urb(frame -> bulk_urb);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+static int mpro_frame_start_cmd(struct mpro_frame *frame, gfp_t gfp) {
+
+	struct mpro_device *mpro = frame -> mpro;
+	struct mpro_cmd *cmd = &frame -> cmds[frame -> cur];
+
+	/* 0x40 USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE */
+	frame -> setup -> bRequestType = 0x40;
+	frame -> setup -> bRequest = 0xb0;
+	frame -> setup -> wValue = 0;
+	frame -> setup -> wIndex = 0;
+	frame -> setup -> wLength = cpu_to_le16(cmd -> len);
+
+	frame -> ctrl_urb -> transfer_buffer = cmd -> buf;
+	frame -> ctrl_urb -> transfer_buffer_length = cmd -> len;
+
+	trace_mpro_cmd_submit(mpro_minor(mpro), &cmd -> rect, cmd -> size);
+
+	frame -> cmd_start = ktime_get();
+	frame -> parked = false;
+	mpro_xfer_arm(mpro, 0);
+	return usb_submit_urb(frame -> ctrl_urb, gfp);
+}
+
+/*
+ * Submit the next piece of the current command payload. With a chunk
+ * size set the payload goes out in several bulk urbs of at most that
+ * many bytes; scatterlist payloads always go in one.
+ */
+static int mpro_frame_start_bulk(struct mpro_frame *frame) {
+
+	struct mpro_cmd *cmd = &frame -> cmds[frame -> cur];
+	unsigned int len = cmd -> size - frame -> offset;
+
+	if ( frame -> chunk && !cmd -> sgt )
+		len = min(len, frame -> chunk);
+
+	// streamed frame, only what is converted already
+	if ( cmd -> data == frame -> data )
+		len = min(len, READ_ONCE(frame -> ready) - frame -> offset);
+
+	frame -> bulk_urb -> transfer_buffer = cmd -> data ? cmd -> data + frame -> offset : NULL;
+	frame -> bulk_urb -> transfer_buffer_length = len;
+	frame -> bulk_urb -> sg = cmd -> sgt ? cmd -> sgt -> sgl : NULL;
+	frame -> bulk_urb -> num_sgs = cmd -> sgt ? cmd -> sgt -> nents : 0;
+
+	trace_mpro_bulk_start(mpro_minor(frame -> mpro), frame -> cur, frame -> offset, len);
+
+	mpro_xfer_arm(frame -> mpro, len);
+	return usb_submit_urb(frame -> bulk_urb, GFP_ATOMIC);
+}
+
+/*
+ * Next bulk urb of the current command. A streamed frame whose payload
+ * is not converted that far yet is parked, mpro_frame_ready() goes on.
+ */
+static int mpro_frame_continue(struct mpro_frame *frame) {
+
+	struct mpro_device *mpro = frame -> mpro;
+	struct mpro_cmd *cmd = &frame -> cmds[frame -> cur];
+	unsigned long flags;
+	bool starved;
+
+	if ( cmd -> data == frame -> data ) {
+
+		spin_lock_irqsave(&mpro -> xfer_lock, flags);
+		starved = frame -> offset >= frame -> ready;
+		frame -> starved = starved;
+		frame -> parked |= starved;
+
+		// nothing on the wire to watch
+		if ( starved )
+			hrtimer_try_to_cancel(&mpro -> xfer_timer);
+		spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+		if ( starved )
+			return 0;
+	}
+
+	return mpro_frame_start_bulk(frame);
+}
+
+/*
+ * Release frame -> data up to ready bytes to a streamed full frame
+ * update, submitting the next bulk urb if the transfer was waiting.
+ */
+void mpro_frame_ready(struct mpro_device *mpro, struct mpro_frame *frame, unsigned int ready) {
+
+	unsigned long flags;
+	bool starved;
+	int ret;
+
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+	WRITE_ONCE(frame -> ready, ready);
+	starved = frame -> starved;
+	frame -> starved = false;
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	if ( !starved )
+		return;
+
+	ret = mpro_frame_start_bulk(frame);
+	if ( ret )
+		mpro_frame_done(frame, ret);
+}
+
+static void mpro_ctrl_complete(struct urb *urb) {
+
+	struct mpro_frame *frame = urb -> context;
+	ktime_t now = ktime_get();
+	int ret;
+
+	mpro_xfer_disarm(frame -> mpro);
+
+	if ( urb -> status ) {
+		mpro_frame_done(frame, urb -> status);
+		return;
+	}
+
+	frame -> ctrl_ns = ktime_to_ns(ktime_sub(now, frame -> cmd_start));
+	frame -> cmd_start = now;
+	frame -> offset = 0;
+	mpro_perf_latency(frame -> mpro, MPRO_LAT_CTRL, frame -> ctrl_ns);
+
+	ret = mpro_frame_continue(frame);
+	if ( ret )
+		mpro_frame_done(frame, ret);
+}
+
+/* Running averages of command round trip and bulk rate, see mpro_cmd_cost() */
+static void mpro_link_measure(struct mpro_frame *frame) {
+
+	struct mpro_device *mpro = frame -> mpro;
+	struct mpro_cmd *cmd = &frame -> cmds[frame -> cur];
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), frame -> cmd_start));
+	u64 ctrl_ns = READ_ONCE(mpro -> ctrl_ns);
+	u64 rate = READ_ONCE(mpro -> rate);
+
+	WRITE_ONCE(mpro -> ctrl_ns, ctrl_ns ? (7 * ctrl_ns + frame -> ctrl_ns) / 8 : frame -> ctrl_ns);
+
+	// a streamed command waiting for conversion measures the conversion
+	if ( frame -> parked )
+		return;
+
+	mpro_perf_latency(mpro, MPRO_LAT_BULK, ns);
+
+	if ( cmd -> size < MPRO_RATE_MIN_BYTES || !ns )
+		return;
+
+	ns = div64_u64((u64)cmd -> size * NSEC_PER_SEC, ns);
+	WRITE_ONCE(mpro -> rate, rate ? (7 * rate + ns) / 8 : ns);
+}
+
+static void mpro_bulk_complete(struct urb *urb) {
+
+	struct mpro_frame *frame = urb -> context;
+	int ret;
+
+	trace_mpro_bulk_done(mpro_minor(frame -> mpro), frame -> cur, urb -> actual_length, urb -> status);
+
+	mpro_xfer_disarm(frame -> mpro);
+
+	if ( urb -> status ) {
+		mpro_frame_done(frame, urb -> status);
+		return;
+	}
+
+	mpro_perf_add(frame -> mpro, MPRO_PERF_BYTES, urb -> actual_length);
+
+	frame -> offset += urb -> transfer_buffer_length;
+	if ( frame -> offset < frame -> cmds[frame -> cur].size ) {
+		ret = mpro_frame_continue(frame);
+		if ( ret )
+			mpro_frame_done(frame, ret);
+		return;
+	}
+
+	mpro_link_measure(frame);
+
+	if ( ++frame -> cur < frame -> ncmds ) {
+		ret = mpro_frame_start_cmd(frame, GFP_ATOMIC);
+		if ( ret )
+			mpro_frame_done(frame, ret);
+		return;
+	}
+
+	mpro_frame_done(frame, 0);
+}
+
+/*
+ * Errors of a busy bus get the current command sent again from its
+ * cmd_draw, a bounded number of times per frame. Urbs killed by the
+ * driver and a device that is gone end the frame.
+ */
+static bool mpro_frame_retry(struct mpro_frame *frame, int status) {
+
+	struct mpro_device *mpro = frame -> mpro;
+	unsigned long flags;
+	bool retry = false;
+
+	switch ( status ) {
+	case 0:
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+	case -ENODEV:
+		return false;
+	}
+
+	// under xfer_lock, so mpro_urb_stop() either sees the work queued or we see stopped
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+	if ( !mpro -> stopped && frame -> retries < MPRO_XFER_RETRIES ) {
+		frame -> retries++;
+		mpro -> retry_status = status;
+		schedule_work(&mpro -> retry_work);
+		retry = true;
+	}
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	if ( retry )
+		mpro_perf_add(mpro, MPRO_PERF_RETRIES, 1);
+
+	return retry;
+}
+
+static void mpro_retry_work(struct work_struct *work) {
+
+	struct mpro_device *mpro = container_of(work, struct mpro_device, retry_work);
+	struct mpro_frame *frame = READ_ONCE(mpro -> active);
+	struct usb_device *udev = mpro_to_usb_device(mpro);
+	int ret;
+
+	if ( !frame )
+		return;
+
+	drm_dbg(&mpro -> dev, "command %u failed: %d, sending it again\n", frame -> cur, mpro -> retry_status);
+
+	// stalled bulk endpoint takes nothing until the halt is cleared
+	if ( mpro -> retry_status == -EPIPE ) {
+		ret = usb_clear_halt(udev, usb_sndbulkpipe(udev, 0x02));
+		if ( ret ) {
+			mpro_frame_done(frame, ret);
+			return;
+		}
+	}
+
+	ret = mpro_frame_start_cmd(frame, GFP_KERNEL);
+	if ( ret )
+		mpro_frame_done(frame, ret);
+}
+
+static void mpro_frame_done(struct mpro_frame *frame, int status) {
+
+	struct mpro_device *mpro = frame -> mpro;
+	struct mpro_frame *next = NULL;
+	ktime_t now = ktime_get();
+	bool vblank = false;
+	unsigned long flags;
+	unsigned int i;
+
+	mpro_xfer_disarm(mpro);
+
+	if ( status && frame -> timedout )
+		status = -ETIMEDOUT;
+	frame -> timedout = false;
+
+	if ( status && status != -ENOENT && status != -ECONNRESET && status != -ESHUTDOWN ) {
+		drm_dbg(&mpro -> dev, "frame transfer failed: %d\n", status);
+		mpro_perf_add(mpro, MPRO_PERF_USB_ERRORS, 1);
+	}
+
+	if ( mpro_frame_retry(frame, status))
+		return;
+
+	if ( status )
+		trace_mpro_frame_drop(mpro_minor(mpro), status);
+
+	if ( !status )
+		mpro_perf_latency(mpro, MPRO_LAT_COMMIT, ktime_to_ns(ktime_sub(now, frame -> commit)));
+
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+
+	if ( !status ) {
+		u64 ns = ktime_to_ns(ktime_sub(now, frame -> start));
+		mpro -> frame_ns = mpro -> frame_ns ? (3 * mpro -> frame_ns + ns) / 4 : ns;
+	}
+
+	frame -> state = MPRO_FRAME_IDLE;
+	frame -> status = status;
+	mpro -> active = NULL;
+
+	if ( status )
+		mpro_perf_add(mpro, MPRO_PERF_DROPPED, 1);
+
+	// what did not reach the panel goes out again with the next frame
+	if ( status && !mpro -> stopped )
+		for ( i = frame -> cur; i < frame -> ncmds; i++ )
+			mpro_rect_union(&mpro -> lost, &frame -> cmds[i].rect);
+
+	if ( mpro -> pending && !mpro -> stopped ) {
+		next = mpro -> pending;
+		next -> state = MPRO_FRAME_BUSY;
+		next -> start = now;
+		mpro -> active = next;
+	} else if ( mpro -> vblank_deferred && READ_ONCE(mpro -> vblank_on)) {
+		mpro -> vblank_deferred = false;
+		vblank = true;
+	}
+	mpro -> pending = NULL;
+
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	mpro_frame_signal(frame, status);
+	mpro_frame_idle_pm(frame);
+	wake_up_all(&mpro -> xfer_wait);
+
+	/* panel has the frame now, that is our vblank */
+	if ( vblank )
+		drm_crtc_handle_vblank(&mpro -> crtc);
+
+	if ( next ) {
+		int ret = mpro_frame_start_cmd(next, GFP_ATOMIC);
+		if ( ret )
+			mpro_frame_done(next, ret);
+	}
+}
+
+static bool mpro_frame_idle(struct mpro_device *mpro, struct mpro_frame *frame) {
+
+	return READ_ONCE(frame -> state) == MPRO_FRAME_IDLE || READ_ONCE(mpro -> stopped);
+}
+
+/* Drop the framebuffer pages of the last direct transfer from this frame */
+static void mpro_frame_unmap(struct mpro_frame *frame) {
+
+	unsigned int i;
+
+	if ( !frame -> npages )
+		return;
+
+	for ( i = 0; i < frame -> npages; i++ )
+		put_page(frame -> pages[i]);
+
+	sg_free_table(&frame -> sgt);
+	frame -> npages = 0;
+}
+
+/*
+ * Describe a vmapped framebuffer as scatterlist so the bulk urb can
+ * read it in place. The pages are referenced until the frame is reused.
+ * Fails with -E2BIG when the host controller takes fewer entries than
+ * the pages make up, the caller sends a copy then.
+ */
+int mpro_frame_map(struct mpro_frame *frame, const void *vaddr, size_t size) {
+
+	unsigned int i, npages = DIV_ROUND_UP(size, PAGE_SIZE);
+	int ret;
+
+	if ( !is_vmalloc_addr(vaddr) || offset_in_page(vaddr) || npages > DIV_ROUND_UP(frame -> mpro -> block_size, PAGE_SIZE))
+		return -EINVAL;
+
+	for ( i = 0; i < npages; i++ ) {
+		frame -> pages[i] = vmalloc_to_page(vaddr + i * PAGE_SIZE);
+		if ( !frame -> pages[i] )
+			return -EFAULT;
+	}
+
+	ret = sg_alloc_table_from_pages(&frame -> sgt, frame -> pages, npages, 0, size, GFP_KERNEL);
+	if ( ret )
+		return ret;
+
+	if ( frame -> sgt.nents > mpro_to_usb_device(frame -> mpro) -> bus -> sg_tablesize ) {
+		sg_free_table(&frame -> sgt);
+		return -E2BIG;
+	}
+
+	for ( i = 0; i < npages; i++ )
+		get_page(frame -> pages[i]);
+
+	frame -> npages = npages;
+	return 0;
+}
+
+/* Bring frame up to date with pixels that were sent from the other buffer */
+static void mpro_frame_sync(struct mpro_device *mpro, struct mpro_frame *frame) {
+
+	struct mpro_frame *other = &mpro -> frames[(frame - mpro -> frames + 1) % MPRO_FRAMES];
+	struct drm_rect *r = &frame -> stale;
+	unsigned int offset = r -> y1 * mpro -> pitch + r -> x1 * MPRO_BPP / 8;
+	unsigned int len = drm_rect_width(r) * MPRO_BPP / 8;
+	int y;
+
+	if ( !drm_rect_visible(r))
+		return;
+
+	for ( y = r -> y1; y < r -> y2; y++ ) {
+		memcpy(frame -> data + offset, other -> data + offset, len);
+		offset += mpro -> pitch;
+	}
+
+	*r = DRM_RECT_INIT(0, 0, 0, 0);
+}
+
+/*
+ * Latest wins: a frame still waiting for the wire is taken back, the
+ * caller adds its damage to it and the union goes out in one transfer.
+ * Its rects are kept in carry so the caller can send them again.
+ */
+static struct mpro_frame *mpro_frame_reclaim(struct mpro_device *mpro) {
+
+	struct mpro_frame *frame;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+	frame = mpro -> pending;
+	if ( frame ) {
+		mpro -> pending = NULL;
+		frame -> state = MPRO_FRAME_IDLE;
+	}
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	if ( !frame )
+		return NULL;
+
+	for ( i = 0; i < frame -> ncmds; i++ )
+		frame -> carry[i] = frame -> cmds[i].rect;
+	frame -> ncarry = frame -> ncmds;
+
+	mpro -> next = frame - mpro -> frames;
+	mpro_perf_add(mpro, MPRO_PERF_COALESCED, 1);
+	return frame;
+}
+
+/*
+ * Whether the frame waiting for the wire is sent from a framebuffer
+ * mapping; taking it back would lose its pixels, the mapping does not
+ * survive mpro_frame_begin().
+ */
+bool mpro_frame_pending_direct(struct mpro_device *mpro) {
+
+	unsigned long flags;
+	bool direct;
+
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+	direct = mpro -> pending && mpro -> pending -> npages;
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	return direct;
+}
+
+/*
+ * Returns the back buffer, waiting for it if both buffers are still
+ * busy. Caller converts into frame -> data, adds commands with
+ * mpro_blit() and hands it back with mpro_frame_flush().
+ */
+struct mpro_frame *mpro_frame_begin(struct mpro_device *mpro) {
+
+	struct mpro_frame *frame;
+	long timeout = mpro_frame_timeout(mpro);
+	struct drm_rect lost;
+	unsigned long flags;
+
+	frame = mpro_frame_reclaim(mpro);
+	if ( frame )
+		goto out;
+
+	frame = &mpro -> frames[mpro -> next];
+	frame -> ncarry = 0;
+
+	if ( !wait_event_timeout(mpro -> xfer_wait, mpro_frame_idle(mpro, frame), timeout)) {
+
+		struct mpro_frame *active = READ_ONCE(mpro -> active);
+
+		drm_warn(&mpro -> dev, "frame transfer timed out\n");
+		mpro_perf_add(mpro, MPRO_PERF_TIMEOUTS, 1);
+
+		/* completion handler releases the frame and starts the pending one */
+		if ( active ) {
+			usb_kill_urb(active -> ctrl_urb);
+			usb_kill_urb(active -> bulk_urb);
+		}
+
+		if ( !wait_event_timeout(mpro -> xfer_wait, mpro_frame_idle(mpro, frame), timeout)) {
+			mpro_perf_add(mpro, MPRO_PERF_DROPPED, 1);
+			trace_mpro_frame_drop(mpro_minor(mpro), -ETIMEDOUT);
+			return ERR_PTR(-ETIMEDOUT);
+		}
+	}
+
+	if ( READ_ONCE(mpro -> stopped))
+		return ERR_PTR(-ENODEV);
+
+	mpro_frame_sync(mpro, frame);
+
+out:
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+	lost = mpro -> lost;
+	mpro -> lost = (struct drm_rect){ };
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	// rects of a dropped frame are carried like those of a taken back one
+	if ( drm_rect_visible(&lost)) {
+		if ( frame -> ncarry < MPRO_MAX_CMDS )
+			frame -> carry[frame -> ncarry++] = lost;
+		else
+			mpro_rect_union(&frame -> carry[MPRO_MAX_CMDS - 1], &lost);
+	}
+
+	frame -> commit = ktime_get();
+	mpro_frame_unmap(frame);
+	frame -> ready = UINT_MAX;
+	frame -> starved = false;
+	frame -> ncmds = 0;
+	frame -> cur = 0;
+	frame -> pack_len = 0;
+
+	return frame;
+}
+
+/*
+ * Queue frame for transfer. area is the region of frame -> data that was
+ * rewritten since mpro_frame_begin(); the other buffer is marked stale
+ * there so it gets refreshed before it is used next time.
+ */
+/*
+ * Blits are counted once the frame goes out: a full blit replaces the
+ * partial ones queued before it, so what mpro_blit() appended earlier is
+ * not necessarily what reaches the wire.
+ */
+static void mpro_frame_count(struct mpro_device *mpro, struct mpro_frame *frame) {
+
+	struct mpro_cmd *cmd;
+	unsigned int i;
+
+	for ( i = 0; i < frame -> ncmds; i++ ) {
+
+		cmd = &frame -> cmds[i];
+		mpro_perf_add(mpro, drm_rect_equals(&cmd -> rect, &mpro -> info.rect) ?
+			MPRO_PERF_FULL_BLITS : MPRO_PERF_PARTIAL_BLITS, 1);
+		mpro_perf_add(mpro, MPRO_PERF_SENT_PIXELS, drm_rect_width(&cmd -> rect) * drm_rect_height(&cmd -> rect));
+	}
+}
+
+int mpro_frame_flush(struct mpro_device *mpro, struct mpro_frame *frame, const struct drm_rect *area) {
+
+	unsigned int idx = frame - mpro -> frames;
+	bool start = false;
+	unsigned long flags;
+	int i, ret;
+
+	for ( i = 0; i < MPRO_FRAMES; i++ )
+		if ( i != idx )
+			mpro_rect_union(&mpro -> frames[i].stale, area);
+
+	if ( !frame -> ncmds ) {
+		mpro_frame_signal(frame, 0);
+		mpro_frame_idle_pm(frame);
+		return 0;
+	}
+
+	mpro -> next = (idx + 1) % MPRO_FRAMES;
+
+	// wakes the device; a frame taken back still has its reference
+	if ( !frame -> pm ) {
+		ret = usb_autopm_get_interface(to_usb_interface(mpro -> dev.dev));
+		if ( ret ) {
+			mpro_frame_signal(frame, ret);
+			return ret;
+		}
+		frame -> pm = 1;
+	}
+
+	// this frame is what the panel shows after a resume, no replay needed
+	WRITE_ONCE(mpro -> replay, false);
+
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+
+	if ( mpro -> stopped ) {
+		spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+		mpro_frame_signal(frame, -ENODEV);
+		mpro_frame_idle_pm(frame);
+		return -ENODEV;
+	}
+
+	frame -> cur = 0;
+	frame -> status = 0;
+	frame -> retries = 0;
+	frame -> timedout = false;
+	frame -> chunk = mpro -> config.chunk;
+	mpro_perf_add(mpro, MPRO_PERF_FRAMES, 1);
+	mpro_frame_count(mpro, frame);
+
+	if ( !mpro -> active ) {
+		frame -> state = MPRO_FRAME_BUSY;
+		frame -> start = ktime_get();
+		mpro -> active = frame;
+		start = true;
+	} else {
+		frame -> state = MPRO_FRAME_QUEUED;
+		mpro -> pending = frame;
+	}
+
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	if ( start ) {
+		ret = mpro_frame_start_cmd(frame, GFP_KERNEL);
+		if ( ret ) {
+			mpro_frame_done(frame, ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* Called on disconnect; no frame is started after this returns */
+void mpro_urb_stop(struct mpro_device *mpro) {
+
+	struct mpro_frame *active;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&mpro -> xfer_lock, flags);
+	mpro -> stopped = true;
+	spin_unlock_irqrestore(&mpro -> xfer_lock, flags);
+
+	// a frame waiting for its retry has no urb to kill, end it here
+	if ( cancel_work_sync(&mpro -> retry_work)) {
+		active = READ_ONCE(mpro -> active);
+		if ( active )
+			mpro_frame_done(active, -ESHUTDOWN);
+	}
+
+	hrtimer_cancel(&mpro -> xfer_timer);
+
+	for ( i = 0; i < MPRO_FRAMES; i++ ) {
+		usb_kill_urb(mpro -> frames[i].ctrl_urb);
+		usb_kill_urb(mpro -> frames[i].bulk_urb);
+	}
+
+	cancel_work_sync(&mpro -> replay_work);
+
+	// a queued frame never goes out now, nobody waits on its fence forever
+	for ( i = 0; i < MPRO_FRAMES; i++ ) {
+		mpro_frame_signal(&mpro -> frames[i], -ENODEV);
+		mpro_frame_idle_pm(&mpro -> frames[i]);
+	}
+
+	wake_up_all(&mpro -> xfer_wait);
+}
+
+static bool mpro_xfer_idle(struct mpro_device *mpro) {
+
+	return !READ_ONCE(mpro -> active) && !READ_ONCE(mpro -> pending);
+}
+
+/*
+ * Nothing may be on the wire while the device sleeps. Frames hold pm
+ * references, so an autosuspend finds the link idle; system sleep waits
+ * for the frames on their way.
+ */
+int mpro_urb_suspend(struct mpro_device *mpro, bool autosuspend) {
+
+	if ( autosuspend && !mpro_xfer_idle(mpro))
+		return -EBUSY;
+
+	if ( !wait_event_timeout(mpro -> xfer_wait, mpro_xfer_idle(mpro), mpro_frame_timeout(mpro)))
+		return -EBUSY;
+
+	hrtimer_cancel(&mpro -> xfer_timer);
+	return 0;
+}
+
+/*
+ * Panel may have lost its picture while the device slept, send the last
+ * frame again; not when a commit or flush woke the device or sent a frame
+ * since, that frame goes out anyway.
+ */
+static void mpro_replay_work(struct work_struct *work) {
+
+	struct mpro_device *mpro = container_of(work, struct mpro_device, replay_work);
+	struct drm_rect area = { };
+	struct mpro_frame *frame;
+	int idx;
+
+	if ( !drm_dev_enter(&mpro -> dev, &idx))
+		return;
+
+	mutex_lock(&mpro -> config_lock);
+
+	if ( !READ_ONCE(mpro -> replay) || !mpro_xfer_idle(mpro))
+		goto out_mutex_unlock;
+
+	// frames lack the framebuffer last sent directly, the next commit sends it whole
+	if ( mpro -> resync ) {
+		mpro -> redraw = true;
+		goto out_mutex_unlock;
+	}
+
+	frame = mpro_frame_begin(mpro);
+	if ( IS_ERR(frame))
+		goto out_mutex_unlock;
+
+	mpro_blit(mpro, frame, &mpro -> info.rect);
+	mpro_frame_flush(mpro, frame, &area);
+
+out_mutex_unlock:
+	mutex_unlock(&mpro -> config_lock);
+	drm_dev_exit(idx);
+}
+
+/* Called from the resume callback, which must not wait for config_lock */
+void mpro_urb_resume(struct mpro_device *mpro) {
+
+	WRITE_ONCE(mpro -> replay, true);
+	schedule_work(&mpro -> replay_work);
+}
+
+static void mpro_urb_release(struct drm_device *dev, void *res) {
+
+	struct mpro_device *mpro = to_mpro(dev);
+	int i;
+
+	cancel_work_sync(&mpro -> retry_work);
+	cancel_work_sync(&mpro -> replay_work);
+	hrtimer_cancel(&mpro -> xfer_timer);
+
+	for ( i = 0; i < MPRO_FRAMES; i++ ) {
+		usb_kill_urb(mpro -> frames[i].ctrl_urb);
+		usb_kill_urb(mpro -> frames[i].bulk_urb);
+		usb_free_urb(mpro -> frames[i].ctrl_urb);
+		usb_free_urb(mpro -> frames[i].bulk_urb);
+		mpro_frame_unmap(&mpro -> frames[i]);
+		mpro_frame_signal(&mpro -> frames[i], -ENODEV);
+	}
+}
+
+int mpro_urb_init(struct mpro_device *mpro) {
+
+	struct drm_device *dev = &mpro -> dev;
+	struct usb_device *udev = mpro_to_usb_device(mpro);
+	int i, j, ret;
+
+	spin_lock_init(&mpro -> xfer_lock);
+	init_waitqueue_head(&mpro -> xfer_wait);
+	spin_lock_init(&mpro -> fence_lock);
+	mpro -> fence_context = dma_fence_context_alloc(1);
+	hrtimer_init(&mpro -> xfer_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	mpro -> xfer_timer.function = mpro_xfer_timer;
+	INIT_WORK(&mpro -> retry_work, mpro_retry_work);
+	INIT_WORK(&mpro -> replay_work, mpro_replay_work);
+
+	for ( i = 0; i < MPRO_FRAMES; i++ ) {
+
+		struct mpro_frame *frame = &mpro -> frames[i];
+
+		frame -> mpro = mpro;
+		frame -> state = MPRO_FRAME_IDLE;
+
+		frame -> data = drmm_kzalloc(dev, PAGE_ALIGN(mpro -> block_size), GFP_KERNEL);
+		frame -> pack = drmm_kmalloc(dev, PAGE_ALIGN(mpro -> block_size), GFP_KERNEL);
+		frame -> setup = drmm_kzalloc(dev, sizeof(*frame -> setup), GFP_KERNEL);
+		frame -> cmdbuf = drmm_kzalloc(dev, MPRO_MAX_CMDS * MPRO_CMD_SIZE, GFP_KERNEL);
+		frame -> pages = drmm_kcalloc(dev, DIV_ROUND_UP(mpro -> block_size, PAGE_SIZE),
+					      sizeof(*frame -> pages), GFP_KERNEL);
+		if ( !frame -> data || !frame -> pack || !frame -> setup || !frame -> cmdbuf || !frame -> pages ) {
+			ret = -ENOMEM;
+			goto err_free_urbs;
+		}
+
+		for ( j = 0; j < MPRO_MAX_CMDS; j++ )
+			frame -> cmds[j].buf = frame -> cmdbuf + j * MPRO_CMD_SIZE;
+
+		frame -> ctrl_urb = usb_alloc_urb(0, GFP_KERNEL);
+		frame -> bulk_urb = usb_alloc_urb(0, GFP_KERNEL);
+		if ( !frame -> ctrl_urb || !frame -> bulk_urb ) {
+			usb_free_urb(frame -> ctrl_urb);
+			usb_free_urb(frame -> bulk_urb);
+			frame -> ctrl_urb = NULL;
+			frame -> bulk_urb = NULL;
+			ret = -ENOMEM;
+			goto err_free_urbs;
+		}
+
+		usb_fill_control_urb(frame -> ctrl_urb, udev, usb_sndctrlpipe(udev, 0),
+				     (unsigned char *)frame -> setup, NULL, 0,
+				     mpro_ctrl_complete, frame);
+
+		usb_fill_bulk_urb(frame -> bulk_urb, udev, usb_sndbulkpipe(udev, 0x02),
+				  NULL, 0, mpro_bulk_complete, frame);
+	}
+
+	return drmm_add_action_or_reset(dev, mpro_urb_release, NULL);
+
+err_free_urbs:
+	while ( i-- > 0 ) {
+		usb_free_urb(mpro -> frames[i].ctrl_urb);
+		usb_free_urb(mpro -> frames[i].bulk_urb);
+		mpro -> frames[i].ctrl_urb = NULL;
+		mpro -> frames[i].bulk_urb = NULL;
+	}
+	return ret;
+}